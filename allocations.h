@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <string>
+
+#include <sys/resource.h>
+
+namespace pam2qoi
+{
+
+	// Where memory is allocated, for sizing the containers
+	enum class AllocationSite : unsigned int {
+		OTHER,
+		IMAGE_PIXELS,
+		LINE_BUFFER,
+		STRIPE
+	};
+
+	struct AllocationStatistics {
+		std::uint64_t allocations = 0;
+		std::uint64_t reallocations = 0;
+		std::uint64_t bytes = 0;
+	};
+
+	// Sets the site of the calling thread's allocations while it lives.
+	// The program's global `operator new` has to call `count()`, which
+	// sums up the allocations and their bytes by site once `enable()`
+	// was called. An allocation in a scope that already allocated, like
+	// a growing `std::string`, counts as a reallocation.
+	class AllocationScope final
+	{
+	public:
+		explicit AllocationScope(AllocationSite site) :
+			site_(site),
+			outer_(current)
+		{
+			current = this;
+		}
+
+		AllocationScope(const AllocationScope& other) = delete;
+		AllocationScope& operator =(const AllocationScope& other) = delete;
+
+		~AllocationScope()
+		{
+			current = outer_;
+		}
+
+		static void count(std::size_t size)
+		{
+			if (!enabled.load(std::memory_order_relaxed)) {
+				return;
+			}
+
+			const AllocationScope* const scope = current;
+			Counters& counters = sites[static_cast<unsigned int>(scope ? scope->site_ : AllocationSite::OTHER)];
+
+			++counters.allocations;
+			counters.bytes += size;
+
+			if (scope && scope->allocations_++) {
+				++counters.reallocations;
+			}
+		}
+
+		static void enable()
+		{
+			enabled = true;
+		}
+
+		static bool isEnabled()
+		{
+			return enabled;
+		}
+
+		static AllocationStatistics get(AllocationSite site)
+		{
+			const Counters& counters = sites[static_cast<unsigned int>(site)];
+
+			return {counters.allocations, counters.reallocations, counters.bytes};
+		}
+
+	private:
+		// Zero as static storage
+		struct Counters {
+			std::atomic<std::uint64_t> allocations;
+			std::atomic<std::uint64_t> reallocations;
+			std::atomic<std::uint64_t> bytes;
+		};
+
+		const AllocationSite site_;
+		AllocationScope* const outer_;
+		mutable std::size_t allocations_ = 0;
+
+		inline static std::atomic<bool> enabled{false};
+		inline static std::array<Counters, 4> sites;
+		inline static thread_local AllocationScope* current = nullptr;
+	};
+
+	inline const char* getAllocationSiteName(AllocationSite site)
+	{
+		switch (site) {
+			case AllocationSite::OTHER: {
+				return "other";
+			}
+
+			case AllocationSite::IMAGE_PIXELS: {
+				return "image pixels";
+			}
+
+			case AllocationSite::LINE_BUFFER: {
+				return "line buffer";
+			}
+
+			case AllocationSite::STRIPE: {
+				return "stripes";
+			}
+		}
+
+		return {};
+	}
+
+	// Restarts the peak resident set size of the process, so the next
+	// `getPeakRss()` is the peak of what ran in between. Linux only, false
+	// if it can't.
+	inline bool resetPeakRss()
+	{
+		std::ofstream file("/proc/self/clear_refs");
+		file << "5" << std::endl;
+
+		return static_cast<bool>(file);
+	}
+
+	// The peak resident set size in bytes since the start or the last
+	// `resetPeakRss()`
+	inline std::optional<std::uint64_t> getPeakRss()
+	{
+		std::ifstream file("/proc/self/status");
+
+		for (std::string line; std::getline(file, line);) {
+			if (line.compare(0, 6, "VmHWM:") == 0) {
+				return std::stoull(line.substr(6)) * 1024;
+			}
+		}
+
+		// Not resettable, but there on any POSIX system
+		rusage usage;
+
+		if (getrusage(RUSAGE_SELF, &usage) == 0) {
+			// Kilobytes, except on macOS
+#if defined(__APPLE__)
+			return usage.ru_maxrss;
+#else
+			return static_cast<std::uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+		}
+
+		return std::nullopt;
+	}
+
+}
@@ -0,0 +1,377 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace pam2qoi
+{
+
+	// Keeps the compiler from optimizing away benchmarked results
+	template<typename T>
+	void doNotOptimize(const T& value)
+	{
+#if defined(__GNUC__)
+		asm volatile("" : : "r,m"(value) : "memory");
+#else
+		static volatile const void* sink;
+		sink = &value;
+#endif
+	}
+
+	// A minimal stand-in for Google Benchmark: The benchmarked code runs in
+	// `while (state.keepRunning()) {...}`, and everything outside of the loop
+	// is setup that doesn't count.
+	class BenchmarkState final
+	{
+	public:
+		explicit BenchmarkState(std::size_t iterations) :
+			iterations_(iterations),
+			remaining_(iterations),
+			elapsed_(0)
+		{
+		}
+
+		bool keepRunning()
+		{
+			const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+			if (remaining_ == iterations_) {
+				start_ = now;
+			}
+
+			if (!remaining_) {
+				elapsed_ += now - start_;
+				return false;
+			}
+
+			--remaining_;
+
+			return true;
+		}
+
+		void pauseTiming()
+		{
+			elapsed_ += std::chrono::steady_clock::now() - start_;
+		}
+
+		void resumeTiming()
+		{
+			start_ = std::chrono::steady_clock::now();
+		}
+
+		// Pixels and bytes handled by one iteration
+		void setItemsProcessed(std::size_t items)
+		{
+			items_ = items;
+		}
+
+		void setBytesProcessed(std::size_t bytes)
+		{
+			bytes_ = bytes;
+		}
+
+		// Additional per benchmark values like the compression ratio
+		void setCounter(const std::string& name, double value)
+		{
+			counters_[name] = value;
+		}
+
+		std::size_t getIterations() const
+		{
+			return iterations_;
+		}
+
+		double getSeconds() const
+		{
+			return std::chrono::duration<double>(elapsed_).count();
+		}
+
+		std::size_t getItemsProcessed() const
+		{
+			return items_;
+		}
+
+		std::size_t getBytesProcessed() const
+		{
+			return bytes_;
+		}
+
+		const std::map<std::string, double>& getCounters() const
+		{
+			return counters_;
+		}
+
+	private:
+		std::size_t iterations_;
+		std::size_t remaining_;
+
+		std::chrono::steady_clock::time_point start_;
+		std::chrono::steady_clock::duration elapsed_;
+
+		std::size_t items_ = 0;
+		std::size_t bytes_ = 0;
+		std::map<std::string, double> counters_;
+	};
+
+	class BenchmarkRunner final
+	{
+	public:
+		using Parameters = std::vector<std::pair<std::string, std::string>>;
+		using Function = std::function<void (BenchmarkState&)>;
+
+		struct Result {
+			std::string name;
+			Parameters parameters;
+			std::size_t iterations;
+			double ns_per_iteration;
+			double mpix_per_second;
+			double mb_per_second;
+			std::map<std::string, double> counters;
+		};
+
+		BenchmarkRunner(double min_seconds, unsigned int repetitions) :
+			min_seconds_(min_seconds),
+			repetitions_(std::max(1U, repetitions))
+		{
+		}
+
+		void add(const std::string& name, const Parameters& parameters, const Function& function)
+		{
+			benchmarks_.push_back({name, parameters, function, false});
+		}
+
+		// A memory bandwidth benchmark. They run first, whatever the filter,
+		// and the highest MB/s of them with the same "threads" parameter
+		// is the roofline of the other benchmarks: Their MB/s are also
+		// given as the counter "roofline" in percent of it. Without a
+		// "threads" parameter a benchmark runs on one thread.
+		void addRoofline(const std::string& name, const Parameters& parameters, const Function& function)
+		{
+			benchmarks_.push_back({name, parameters, function, true});
+		}
+
+		// Runs every benchmark whose name contains `filter` and reports the
+		// median of the repetitions
+		std::vector<Result> run(const std::string& filter, std::ostream& log) const
+		{
+			std::vector<Result> res;
+
+			// MB/s by threads
+			std::map<std::string, double> rooflines;
+
+			const auto get_threads =
+				[](const Parameters& parameters) -> std::string
+				{
+					for (const auto& parameter : parameters) {
+						if (parameter.first == "threads") {
+							return parameter.second;
+						}
+					}
+
+					return "1";
+				};
+
+			std::vector<const Benchmark*> benchmarks;
+
+			for (const bool roofline : {true, false}) {
+				for (const Benchmark& benchmark : benchmarks_) {
+					if (benchmark.roofline == roofline && (roofline || benchmark.name.find(filter) != std::string::npos)) {
+						benchmarks.push_back(&benchmark);
+					}
+				}
+			}
+
+			log << std::left << std::setw(48) << "benchmark" << std::right << std::setw(14) << "ns/iter" << std::setw(12) << "Mpix/s" << std::setw(12) << "MB/s" << "  counters" << std::endl;
+
+			for (const Benchmark* const benchmark_pointer : benchmarks) {
+				const Benchmark& benchmark = *benchmark_pointer;
+
+				// Calibration: grow the iterations until a run takes long enough
+				std::size_t iterations = 1;
+
+				for (;;) {
+					BenchmarkState state(iterations);
+					benchmark.function(state);
+
+					if (state.getSeconds() >= min_seconds_ || iterations >= 1000000000) {
+						break;
+					}
+
+					const double factor = state.getSeconds() > 0 ? min_seconds_ * 1.4 / state.getSeconds() : 100;
+					iterations = std::max(iterations + 1, static_cast<std::size_t>(iterations * std::min(factor, 100.0)));
+				}
+
+				std::vector<BenchmarkState> states;
+				states.reserve(repetitions_);
+
+				for (unsigned int i = 0; i < repetitions_; ++i) {
+					states.emplace_back(iterations);
+					benchmark.function(states.back());
+				}
+
+				std::sort(
+					states.begin(),
+					states.end(),
+					[](const BenchmarkState& a, const BenchmarkState& b)
+					{
+						return a.getSeconds() < b.getSeconds();
+					}
+				);
+
+				const BenchmarkState& median = states[states.size() / 2];
+				const double seconds = median.getSeconds() / iterations;
+
+				Result result = {
+					benchmark.name,
+					benchmark.parameters,
+					iterations,
+					seconds * 1e9,
+					median.getItemsProcessed() / seconds / 1e6,
+					median.getBytesProcessed() / seconds / 1e6,
+					median.getCounters()
+				};
+
+				const std::string threads = get_threads(result.parameters);
+
+				if (benchmark.roofline) {
+					rooflines[threads] = std::max(rooflines[threads], result.mb_per_second);
+				}
+				else if (rooflines.count(threads) && result.mb_per_second > 0) {
+					result.counters["roofline"] = result.mb_per_second / rooflines[threads] * 100;
+				}
+
+				std::string label = result.name;
+
+				for (const auto& parameter : result.parameters) {
+					label += "/" + parameter.second;
+				}
+
+				log << std::left << std::setw(48) << label << std::right << std::fixed << std::setprecision(0) << std::setw(14) << result.ns_per_iteration << std::setprecision(1) << std::setw(12) << result.mpix_per_second << std::setw(12) << result.mb_per_second;
+
+				for (const auto& counter : result.counters) {
+					log << "  " << counter.first << "=" << std::setprecision(3) << counter.second;
+				}
+
+				log << std::endl;
+
+				res.push_back(std::move(result));
+			}
+
+			return res;
+		}
+
+		// One line per result, parameters and counters get their own columns
+		static void writeCsv(const std::vector<Result>& results, std::ostream& stream)
+		{
+			std::vector<std::string> parameter_names;
+			std::vector<std::string> counter_names;
+
+			const auto add_name =
+				[](std::vector<std::string>& names, const std::string& name)
+				{
+					if (std::find(names.begin(), names.end(), name) == names.end()) {
+						names.push_back(name);
+					}
+				};
+
+			for (const Result& result : results) {
+				for (const auto& parameter : result.parameters) {
+					add_name(parameter_names, parameter.first);
+				}
+
+				for (const auto& counter : result.counters) {
+					add_name(counter_names, counter.first);
+				}
+			}
+
+			stream << "name";
+
+			for (const std::string& name : parameter_names) {
+				stream << "," << name;
+			}
+
+			stream << ",iterations,ns_per_iteration,mpix_per_second,mb_per_second";
+
+			for (const std::string& name : counter_names) {
+				stream << "," << name;
+			}
+
+			stream << "\n";
+
+			for (const Result& result : results) {
+				stream << result.name;
+
+				for (const std::string& name : parameter_names) {
+					stream << ",";
+
+					for (const auto& parameter : result.parameters) {
+						if (parameter.first == name) {
+							stream << parameter.second;
+						}
+					}
+				}
+
+				stream << std::setprecision(6) << std::defaultfloat << "," << result.iterations << "," << result.ns_per_iteration << "," << result.mpix_per_second << "," << result.mb_per_second;
+
+				for (const std::string& name : counter_names) {
+					stream << ",";
+
+					const auto counter = result.counters.find(name);
+
+					if (counter != result.counters.end()) {
+						stream << counter->second;
+					}
+				}
+
+				stream << "\n";
+			}
+
+			stream.flush();
+		}
+
+	private:
+		struct Benchmark {
+			std::string name;
+			Parameters parameters;
+			Function function;
+			bool roofline;
+		};
+
+		const double min_seconds_;
+		const unsigned int repetitions_;
+
+		std::vector<Benchmark> benchmarks_;
+	};
+
+}
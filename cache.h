@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+namespace pam2qoi
+{
+
+	// A directory of encoded QOIs named by their key. Entries are written
+	// to a temporary file first and then renamed, so concurrent runs
+	// never see half a QOI.
+	class QoiCache final
+	{
+	public:
+		struct Statistics {
+			std::uint64_t hits = 0;
+			std::uint64_t lookups = 0;
+		};
+
+		explicit QoiCache(const std::filesystem::path& directory) :
+			directory_(directory)
+		{
+			std::filesystem::create_directories(directory_);
+		}
+
+		std::optional<std::string> load(const std::string& key) const
+		{
+			std::ifstream file(getPath(key), std::ios::binary);
+
+			if (!file) {
+				return std::nullopt;
+			}
+
+			std::string res((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+			if (file.bad()) {
+				return std::nullopt;
+			}
+
+			return res;
+		}
+
+		void store(const std::string& key, const std::string& data) const
+		{
+			const std::filesystem::path path = getPath(key);
+			const std::filesystem::path temporary = path.string() + ".tmp" + std::to_string(std::random_device()());
+
+			{
+				std::ofstream file(temporary, std::ios::binary);
+				file.write(data.data(), data.size());
+
+				if (!file) {
+					std::filesystem::remove(temporary);
+					throw std::runtime_error("Could not write the cache entry " + temporary.string() + ".");
+				}
+			}
+
+			std::filesystem::rename(temporary, path);
+		}
+
+		// Counts a lookup in the `stats` file of the directory and returns
+		// the totals. Concurrent runs may lose a count now and then.
+		Statistics count(bool hit) const
+		{
+			const std::filesystem::path path = directory_ / "stats";
+
+			Statistics res;
+
+			{
+				std::ifstream file(path);
+				file >> res.hits >> res.lookups;
+
+				if (!file) {
+					res = {};
+				}
+			}
+
+			res.hits += hit;
+			++res.lookups;
+
+			const std::filesystem::path temporary = path.string() + ".tmp" + std::to_string(std::random_device()());
+
+			{
+				std::ofstream file(temporary);
+				file << res.hits << " " << res.lookups << std::endl;
+			}
+
+			std::filesystem::rename(temporary, path);
+
+			return res;
+		}
+
+	private:
+		std::filesystem::path getPath(const std::string& key) const
+		{
+			return directory_ / (key + ".qoi");
+		}
+
+		const std::filesystem::path directory_;
+	};
+
+}
@@ -0,0 +1,66 @@
+# Invoked by the pgo-train target with -P
+
+file(REMOVE_RECURSE "${PROFILE_DIR}")
+file(MAKE_DIRECTORY "${PROFILE_DIR}" "${CORPUS_DIR}")
+
+execute_process(
+	COMMAND "${QOI_BENCH}" --corpus "${CORPUS_DIR}" --size "${CORPUS_SIZE}"
+	RESULT_VARIABLE result
+)
+
+if(result)
+	message(FATAL_ERROR "Writing the corpus failed: ${result}")
+endif()
+
+execute_process(
+	COMMAND "${QOI_BENCH}" --size "${CORPUS_SIZE}" --min-time 0.01 --repetitions 1
+	OUTPUT_QUIET
+	RESULT_VARIABLE result
+)
+
+if(result)
+	message(FATAL_ERROR "Benchmarking the corpus failed: ${result}")
+endif()
+
+file(GLOB corpus "${CORPUS_DIR}/*.pam")
+
+foreach(image ${corpus})
+	foreach(threads 1 0)
+		if(threads)
+			set(arguments ${threads})
+		else()
+			set(arguments)
+		endif()
+
+		execute_process(
+			COMMAND "${PAM2QOI}" ${arguments}
+			INPUT_FILE "${image}"
+			OUTPUT_FILE "${CORPUS_DIR}/train.qoi"
+			ERROR_QUIET
+			RESULT_VARIABLE result
+		)
+
+		if(result)
+			message(FATAL_ERROR "Encoding ${image} failed: ${result}")
+		endif()
+	endforeach()
+endforeach()
+
+file(REMOVE "${CORPUS_DIR}/train.qoi")
+
+if(NOT COMPILER_ID STREQUAL "GNU")
+	if(NOT LLVM_PROFDATA)
+		message(FATAL_ERROR "llvm-profdata is needed to merge the Clang profiles")
+	endif()
+
+	file(GLOB profiles "${PROFILE_DIR}/*.profraw")
+
+	execute_process(
+		COMMAND "${LLVM_PROFDATA}" merge -output "${PROFILE_DIR}/default.profdata" ${profiles}
+		RESULT_VARIABLE result
+	)
+
+	if(result)
+		message(FATAL_ERROR "Merging the profiles failed: ${result}")
+	endif()
+endif()
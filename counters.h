@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace pam2qoi
+{
+
+	// Hardware counter values, empty where the counter couldn't be opened
+	// or was never scheduled
+	struct CounterValues {
+		std::optional<std::uint64_t> cycles;
+		std::optional<std::uint64_t> instructions;
+		std::optional<std::uint64_t> branch_misses;
+		std::optional<std::uint64_t> llc_misses;
+
+		CounterValues& operator +=(const CounterValues& other)
+		{
+			const auto add =
+				[](std::optional<std::uint64_t>& value, const std::optional<std::uint64_t>& other_value)
+				{
+					if (value && other_value) {
+						*value += *other_value;
+					}
+					else {
+						value.reset();
+					}
+				};
+
+			add(cycles, other.cycles);
+			add(instructions, other.instructions);
+			add(branch_misses, other.branch_misses);
+			add(llc_misses, other.llc_misses);
+
+			return *this;
+		}
+	};
+
+	// perf_event counters of the calling thread in user space, and with
+	// `inherit` of the threads it creates while they are enabled, once
+	// those have ended. Counters the kernel or the hardware doesn't
+	// offer are left out, and without any `isAvailable()` is false.
+	class PerfCounters final
+	{
+	public:
+		explicit PerfCounters(bool inherit = false)
+		{
+#if defined(__linux__)
+			const std::uint64_t configs[] = {
+				PERF_COUNT_HW_CPU_CYCLES,
+				PERF_COUNT_HW_INSTRUCTIONS,
+				PERF_COUNT_HW_BRANCH_MISSES,
+				PERF_COUNT_HW_CACHE_MISSES
+			};
+
+			for (int i = 0; i < 4; ++i) {
+				perf_event_attr attr = {};
+				attr.size = sizeof(attr);
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = configs[i];
+				attr.disabled = 1;
+				attr.inherit = inherit;
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				// Scaled up if the counters had to share the hardware
+				attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+				fds_[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+				if (fds_[i] < 0 && error_.empty()) {
+					error_ = std::string("perf_event_open: ") + std::strerror(errno);
+				}
+			}
+#else
+			static_cast<void>(inherit);
+			error_ = "perf_event_open: Not supported on this platform";
+#endif
+		}
+
+		PerfCounters(const PerfCounters& other) = delete;
+		PerfCounters& operator =(const PerfCounters& other) = delete;
+
+		~PerfCounters()
+		{
+#if defined(__linux__)
+			for (const int fd : fds_) {
+				if (fd >= 0) {
+					close(fd);
+				}
+			}
+#endif
+		}
+
+		bool isAvailable() const
+		{
+			for (const int fd : fds_) {
+				if (fd >= 0) {
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		// Why the first counter that failed couldn't be opened
+		const std::string& getError() const
+		{
+			return error_;
+		}
+
+		void start()
+		{
+#if defined(__linux__)
+			for (const int fd : fds_) {
+				if (fd >= 0) {
+					ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+					ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+				}
+			}
+#endif
+		}
+
+		CounterValues stop()
+		{
+			CounterValues res;
+
+#if defined(__linux__)
+			std::optional<std::uint64_t>* const values[] = {
+				&res.cycles,
+				&res.instructions,
+				&res.branch_misses,
+				&res.llc_misses
+			};
+
+			for (int i = 0; i < 4; ++i) {
+				if (fds_[i] < 0) {
+					continue;
+				}
+
+				ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+
+				// Value, time enabled, time running
+				std::uint64_t data[3];
+
+				if (read(fds_[i], data, sizeof(data)) == sizeof(data) && data[2]) {
+					*values[i] = static_cast<std::uint64_t>(static_cast<double>(data[0]) * data[1] / data[2]);
+				}
+			}
+#endif
+
+			return res;
+		}
+
+	private:
+		int fds_[4] = {-1, -1, -1, -1};
+		std::string error_;
+	};
+
+}
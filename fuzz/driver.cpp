@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, std::size_t size);
+
+// Stand-in for libFuzzer where it isn't available (GCC): Runs the entry
+// point on every file and directory given, then on `-runs=N` random
+// mutations of them, and reports the throughput.
+int main(int argc, char** argv)
+try
+{
+	std::size_t runs = 0;
+	std::vector<std::string> inputs;
+
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+
+		if (arg.compare(0, 6, "-runs=") == 0) {
+			runs = std::stoull(arg.substr(6));
+			continue;
+		}
+
+		const auto add_file =
+			[&inputs](const std::filesystem::path& path)
+			{
+				std::ifstream file(path, std::ios::binary);
+				inputs.emplace_back(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+			};
+
+		if (std::filesystem::is_directory(arg)) {
+			for (const auto& entry : std::filesystem::recursive_directory_iterator(arg)) {
+				if (entry.is_regular_file()) {
+					add_file(entry.path());
+				}
+			}
+		}
+		else {
+			add_file(arg);
+		}
+	}
+
+	if (inputs.empty()) {
+		inputs.emplace_back();
+	}
+
+	std::size_t executions = 0;
+	std::size_t bytes = 0;
+
+	const auto execute =
+		[&executions, &bytes](const std::string& input)
+		{
+			LLVMFuzzerTestOneInput(reinterpret_cast<const std::uint8_t*>(input.data()), input.size());
+
+			++executions;
+			bytes += input.size();
+		};
+
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (const std::string& input : inputs) {
+		execute(input);
+	}
+
+	std::mt19937_64 random(0x9E3779B97F4A7C15);
+
+	for (std::size_t run = 0; run < runs; ++run) {
+		std::string input = inputs[random() % inputs.size()];
+
+		for (unsigned int mutations = random() % 8 + 1; mutations; --mutations) {
+			const std::size_t position = input.empty() ? 0 : random() % input.size();
+
+			switch (random() % 4) {
+				case 0: {
+					if (!input.empty()) {
+						input[position] ^= 1 << random() % 8;
+					}
+					break;
+				}
+
+				case 1: {
+					input.insert(position, 1 + random() % 64, static_cast<char>(random()));
+					break;
+				}
+
+				case 2: {
+					input.erase(position, random() % 16);
+					break;
+				}
+
+				case 3: {
+					if (!input.empty()) {
+						input[position] = "0123456789 \n#"[random() % 13];
+					}
+					break;
+				}
+			}
+		}
+
+		execute(input);
+	}
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cerr
+		<< "Executed " << executions << " inputs (" << bytes << " bytes) in " << seconds * 1000 << "ms: "
+		<< executions / seconds << " execs/s, " << bytes / seconds / 1e6 << " MB/s" << std::endl;
+
+	return 0;
+}
+catch (const std::exception& exception)
+{
+	std::cerr << "An error occurred: " << exception.what() << std::endl;
+
+	return 1;
+}
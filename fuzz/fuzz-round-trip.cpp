@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+#include "image.h"
+#include "qoi.h"
+
+using namespace pam2qoi;
+
+// libFuzzer entry point for the encoder and decoder: The input is decoded
+// as a QOI, which may fail cleanly, and then used as pixels that have to
+// survive encodeQoi() in stripes, verifyQoi() and decodeQoi() unchanged,
+// or within the tolerance when encoding near-lossless
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, std::size_t size)
+{
+	const std::string input(reinterpret_cast<const char*>(data), size);
+
+	try {
+		decodeQoi(input, 1 << 20);
+	}
+	catch (const std::runtime_error&) {
+	}
+
+	if (size < 3) {
+		return 0;
+	}
+
+	// First byte: width - 1, second byte: stripes - 1, third byte: the
+	// encoding as below, then RGBA pixels
+	const std::size_t width = data[0] + 1;
+	const std::size_t height = (size - 3) / 4 / width;
+
+	if (!height) {
+		return 0;
+	}
+
+	const std::size_t stripes = data[1] + 1;
+
+	Image image;
+	image.clearAndInitialize(width, height);
+
+	for (std::size_t i = 0; i < width * height; ++i) {
+		const std::uint8_t* const pixel = data + 3 + i * 4;
+
+		image.setPixel(i % width, i / width, {pixel[0], pixel[1], pixel[2], pixel[3]});
+	}
+
+	// Bit 0: fast effort, bit 1: speculative, bits 2 and 3: warm-up of
+	// none, a pixel, a line or everything before, bits 4 to 7: tolerance
+	const std::uint8_t encoding = data[2];
+	const bool speculative = encoding & 0x02;
+	const std::size_t warm_ups[] = {0, 1, width, width * height};
+
+	EncodeOptions options;
+	options.effort = encoding & 0x01 ? Effort::FAST : Effort::NORMAL;
+	options.warm_up = warm_ups[(encoding >> 2) & 0x03];
+	options.near_lossless = encoding >> 4;
+
+	std::string qoi;
+
+	try {
+		QoiIndex index;
+		index.fill(Image::Pixel{0, 0, 0, 0});
+
+		for (const Stripe& stripe : layoutStripes(width, height, stripes)) {
+			std::string part;
+
+			if (speculative) {
+				// As pam2qoi does it, the stripes in order
+				QoiSpeculation speculation;
+				speculation.start_index = guessQoiIndex(image, stripe.begin, options.warm_up ? options.warm_up : width);
+
+				part = encodeQoi(image, stripe, options, &speculation);
+
+				repairQoi(part, speculation, index);
+				advanceQoiIndex(index, speculation);
+			}
+			else {
+				part = encodeQoi(image, stripe, options);
+			}
+
+			verifyQoi(image, part, stripe.begin, stripe.end, options.near_lossless);
+			qoi += part;
+		}
+
+		const Image decoded = decodeQoi(qoi);
+
+		for (std::size_t y = 0; y < height; ++y) {
+			for (std::size_t x = 0; x < width; ++x) {
+				const Image::Pixel expected = image.getPixel(x, y);
+				const Image::Pixel pixel = decoded.getPixel(x, y);
+
+				if (
+					std::abs(pixel.r - expected.r) > static_cast<int>(options.near_lossless)
+					|| std::abs(pixel.g - expected.g) > static_cast<int>(options.near_lossless)
+					|| std::abs(pixel.b - expected.b) > static_cast<int>(options.near_lossless)
+					|| pixel.a != expected.a
+				) {
+					throw std::runtime_error("Round trip mismatch at pixel " + std::to_string(x) + "," + std::to_string(y) + ".");
+				}
+			}
+		}
+	}
+	catch (const std::runtime_error& error) {
+		std::fprintf(stderr, "%s\n", error.what());
+		std::abort();
+	}
+
+	return 0;
+}
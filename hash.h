@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+namespace pam2qoi
+{
+
+	// CRC32C (Castagnoli) of `data` continuing from `crc`, so that hashing
+	// two pieces one after the other gives the CRC of both
+	inline std::uint32_t crc32c(const void* data, std::size_t size, std::uint32_t crc = 0)
+	{
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+
+		crc = ~crc;
+
+#if defined(__SSE4_2__)
+		for (; size >= 8; bytes += 8, size -= 8) {
+			std::uint64_t word;
+			std::memcpy(&word, bytes, sizeof(word));
+			crc = _mm_crc32_u64(crc, word);
+		}
+#else
+		// Slicing by eight: tables[k][i] is the CRC of byte i followed by k
+		// zero bytes
+		static const auto tables =
+			[]()
+			{
+				std::array<std::array<std::uint32_t, 256>, 8> res;
+
+				for (std::uint32_t i = 0; i < 256; ++i) {
+					std::uint32_t value = i;
+
+					for (unsigned int bit = 0; bit < 8; ++bit) {
+						value = value >> 1 ^ (value & 1 ? 0x82F63B78 : 0);
+					}
+
+					res[0][i] = value;
+				}
+
+				for (std::uint32_t i = 0; i < 256; ++i) {
+					for (std::size_t k = 1; k < res.size(); ++k) {
+						res[k][i] = res[k - 1][i] >> 8 ^ res[0][res[k - 1][i] & 0xFF];
+					}
+				}
+
+				return res;
+			}();
+
+		for (; size >= 8; bytes += 8, size -= 8) {
+			const std::uint32_t low = crc ^ (bytes[0] | bytes[1] << 8 | bytes[2] << 16 | std::uint32_t(bytes[3]) << 24);
+
+			crc =
+				tables[7][low & 0xFF]
+				^ tables[6][low >> 8 & 0xFF]
+				^ tables[5][low >> 16 & 0xFF]
+				^ tables[4][low >> 24]
+				^ tables[3][bytes[4]]
+				^ tables[2][bytes[5]]
+				^ tables[1][bytes[6]]
+				^ tables[0][bytes[7]];
+		}
+#endif
+
+		for (; size; ++bytes, --size) {
+#if defined(__SSE4_2__)
+			crc = _mm_crc32_u8(crc, *bytes);
+#else
+			crc = tables[0][(crc ^ *bytes) & 0xFF] ^ crc >> 8;
+#endif
+		}
+
+		return ~crc;
+	}
+
+	// The CRC32C of two pieces from the CRCs of each and the size of the
+	// second, like zlib's crc32_combine(), so stripes can be hashed in
+	// parallel: Appending `size` zero bytes to the first is a linear
+	// operator on its CRC, the product of those for the set bits of
+	// `size`, which are built once.
+	inline std::uint32_t combineCrc32c(std::uint32_t first, std::uint32_t second, std::uint64_t size)
+	{
+		using Matrix = std::array<std::uint32_t, 32>;
+
+		const auto times =
+			[](const Matrix& matrix, std::uint32_t vector) -> std::uint32_t
+			{
+				std::uint32_t res = 0;
+
+				for (std::size_t i = 0; vector; vector >>= 1, ++i) {
+					if (vector & 1) {
+						res ^= matrix[i];
+					}
+				}
+
+				return res;
+			};
+
+		// Appending 2^k zero bytes, for each bit k of `size`
+		static const std::array<Matrix, 64> zeros =
+			[&times]()
+			{
+				const auto square =
+					[&times](const Matrix& matrix) -> Matrix
+					{
+						Matrix res;
+
+						for (std::size_t i = 0; i < res.size(); ++i) {
+							res[i] = times(matrix, matrix[i]);
+						}
+
+						return res;
+					};
+
+				// One zero bit
+				Matrix matrix;
+				matrix[0] = 0x82F63B78;
+
+				for (std::size_t i = 1; i < matrix.size(); ++i) {
+					matrix[i] = std::uint32_t(1) << (i - 1);
+				}
+
+				std::array<Matrix, 64> res;
+				res[0] = square(square(square(matrix)));
+
+				for (std::size_t k = 1; k < res.size(); ++k) {
+					res[k] = square(res[k - 1]);
+				}
+
+				return res;
+			}();
+
+		for (std::size_t k = 0; size; size >>= 1, ++k) {
+			if (size & 1) {
+				first = times(zeros[k], first);
+			}
+		}
+
+		return first ^ second;
+	}
+
+	// Streaming XXH64, so data can be hashed piecewise while it passes by.
+	// The result is the same as that of the reference implementation for
+	// the concatenated pieces.
+	class XxHash64 final
+	{
+	public:
+		explicit XxHash64(std::uint64_t seed = 0) :
+			accumulators_{
+				seed + prime_1 + prime_2,
+				seed + prime_2,
+				seed,
+				seed - prime_1
+			},
+			seed_(seed),
+			length_(0),
+			buffered_(0)
+		{
+		}
+
+		void update(const void* data, std::size_t size)
+		{
+			const unsigned char* bytes = static_cast<const unsigned char*>(data);
+
+			length_ += size;
+
+			if (buffered_) {
+				const std::size_t count = std::min(size, sizeof(buffer_) - buffered_);
+
+				std::memcpy(buffer_ + buffered_, bytes, count);
+				buffered_ += count;
+				bytes += count;
+				size -= count;
+
+				if (buffered_ < sizeof(buffer_)) {
+					return;
+				}
+
+				consume(buffer_);
+				buffered_ = 0;
+			}
+
+			for (; size >= sizeof(buffer_); bytes += sizeof(buffer_), size -= sizeof(buffer_)) {
+				consume(bytes);
+			}
+
+			std::memcpy(buffer_, bytes, size);
+			buffered_ = size;
+		}
+
+		void update(const std::string& data)
+		{
+			update(data.data(), data.size());
+		}
+
+		std::uint64_t digest() const
+		{
+			std::uint64_t res;
+
+			if (length_ >= sizeof(buffer_)) {
+				res = rotate(accumulators_[0], 1) + rotate(accumulators_[1], 7) + rotate(accumulators_[2], 12) + rotate(accumulators_[3], 18);
+
+				for (const std::uint64_t accumulator : accumulators_) {
+					res = (res ^ round(0, accumulator)) * prime_1 + prime_4;
+				}
+			}
+			else {
+				res = seed_ + prime_5;
+			}
+
+			res += length_;
+
+			std::size_t i = 0;
+
+			for (; i + 8 <= buffered_; i += 8) {
+				res = rotate(res ^ round(0, read64(buffer_ + i)), 27) * prime_1 + prime_4;
+			}
+
+			if (i + 4 <= buffered_) {
+				res = rotate(res ^ read32(buffer_ + i) * prime_1, 23) * prime_2 + prime_3;
+				i += 4;
+			}
+
+			for (; i < buffered_; ++i) {
+				res = rotate(res ^ buffer_[i] * prime_5, 11) * prime_1;
+			}
+
+			res ^= res >> 33;
+			res *= prime_2;
+			res ^= res >> 29;
+			res *= prime_3;
+			res ^= res >> 32;
+
+			return res;
+		}
+
+		static std::uint64_t hash(const void* data, std::size_t size, std::uint64_t seed = 0)
+		{
+			XxHash64 res(seed);
+			res.update(data, size);
+			return res.digest();
+		}
+
+	private:
+		static constexpr std::uint64_t prime_1 = 0x9E3779B185EBCA87ULL;
+		static constexpr std::uint64_t prime_2 = 0xC2B2AE3D27D4EB4FULL;
+		static constexpr std::uint64_t prime_3 = 0x165667B19E3779F9ULL;
+		static constexpr std::uint64_t prime_4 = 0x85EBCA77C2B2AE63ULL;
+		static constexpr std::uint64_t prime_5 = 0x27D4EB2F165667C5ULL;
+
+		static std::uint64_t rotate(std::uint64_t value, unsigned int bits)
+		{
+			return value << bits | value >> (64 - bits);
+		}
+
+		static std::uint64_t round(std::uint64_t accumulator, std::uint64_t input)
+		{
+			return rotate(accumulator + input * prime_2, 31) * prime_1;
+		}
+
+		// XXH64 is defined on little endian words
+		static std::uint64_t read64(const unsigned char* bytes)
+		{
+			std::uint64_t res = 0;
+
+			for (unsigned int i = 8; i-- > 0;) {
+				res = res << 8 | bytes[i];
+			}
+
+			return res;
+		}
+
+		static std::uint64_t read32(const unsigned char* bytes)
+		{
+			return
+				std::uint64_t(bytes[0])
+				| std::uint64_t(bytes[1]) << 8
+				| std::uint64_t(bytes[2]) << 16
+				| std::uint64_t(bytes[3]) << 24;
+		}
+
+		void consume(const unsigned char* stripe)
+		{
+			for (unsigned int i = 0; i < 4; ++i) {
+				accumulators_[i] = round(accumulators_[i], read64(stripe + i * 8));
+			}
+		}
+
+		std::uint64_t accumulators_[4];
+		std::uint64_t seed_;
+		std::uint64_t length_;
+
+		unsigned char buffer_[32];
+		std::size_t buffered_;
+	};
+
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "allocations.h"
+
+namespace pam2qoi
+{
+
+	class Image final
+	{
+	public:
+		struct alignas(std::uint32_t) Pixel {
+			using Value = std::uint8_t;
+
+			Value r = 0;
+			Value g = 0;
+			Value b = 0;
+			Value a = 255;
+
+			bool operator ==(const Pixel& other) const
+			{
+				return
+					r == other.r
+					&& g == other.g
+					&& b == other.b
+					&& a == other.a;
+			}
+		};
+
+		Image() :
+			width_(0),
+			height_(0)
+		{
+		}
+
+		Image(Image&& other) noexcept :
+			width_(other.width_),
+			height_(other.height_),
+			pixels_(std::move(other.pixels_))
+		{
+		}
+
+		Image& operator =(Image&& other)
+		{
+			if (this != &other) {
+				width_ = other.width_;
+				height_ = other.height_;
+
+				pixels_ = std::move(other.pixels_);
+			}
+
+			return *this;
+		}
+
+		explicit operator bool() const
+		{
+			return width_ && height_;
+		}
+
+		void clearAndInitialize(std::size_t width, std::size_t height)
+		{
+			width_ = width;
+			height_ = height;
+
+			const AllocationScope scope(AllocationSite::IMAGE_PIXELS);
+
+			pixels_.assign(width * height, {});
+			pixels_.shrink_to_fit();
+		}
+
+		std::size_t getWidth() const
+		{
+			return width_;
+		}
+
+		std::size_t getHeight() const
+		{
+			return height_;
+		}
+
+		Pixel getPixel(std::size_t x, std::size_t y) const
+		{
+			if (x < width_ && y < height_) {
+				return pixels_[width_ * y + x];
+			}
+
+			return {};
+		}
+
+		void setPixel(std::size_t x, std::size_t y, const Pixel& value)
+		{
+			if (x < width_ && y < height_) {
+				pixels_[width_ * y + x] = value;
+			}
+		}
+
+		// Unchecked access to line `y` for converting whole lines at once
+		Pixel* getRow(std::size_t y)
+		{
+			return pixels_.data() + width_ * y;
+		}
+
+		const Pixel* getRow(std::size_t y) const
+		{
+			return pixels_.data() + width_ * y;
+		}
+
+	private:
+		std::size_t width_;
+		std::size_t height_;
+
+		std::vector<Pixel> pixels_;
+	};
+
+}
@@ -0,0 +1,482 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#include "hash.h"
+#include "image.h"
+#include "probes.h"
+
+namespace pam2qoi
+{
+
+	enum class Alpha {
+		KEEP,
+		// Multiply the colors by alpha
+		PREMULTIPLY,
+		// Divide premultiplied colors by alpha
+		UNPREMULTIPLY
+	};
+
+	enum class Swizzle {
+		RGBA,
+		// The tuples are B, G, R and optionally A
+		BGRA
+	};
+
+	struct ReadOptions {
+		// Box filter factor, 1 keeps the original size
+		std::size_t scale = 1;
+		// Bounding box the image is shrunk into, 0 disables fitting
+		std::size_t fit_width = 0;
+		std::size_t fit_height = 0;
+		// Largest accepted WIDTH x HEIGHT of the input, 0 for no limit
+		std::size_t max_pixels = 0;
+		Alpha alpha = Alpha::KEEP;
+		// Anything but RGBA also accepts a custom TUPLTYPE
+		Swizzle swizzle = Swizzle::RGBA;
+	};
+
+	struct PamHeader {
+		std::size_t width;
+		std::size_t height;
+		std::size_t depth;
+	};
+
+	// Parses and checks the header, leaving `stream` at the first body byte.
+	// With `any_tuple_type` the TUPLTYPE isn't checked, only the DEPTH.
+	inline PamHeader readPamHeader(std::istream& stream, bool any_tuple_type = false)
+	{
+		char c;
+
+		if (
+			!stream.get(c)
+			|| c != 'P'
+			|| !stream.get(c)
+			|| c != '7'
+			|| !stream.get(c)
+			|| c != '\n'
+		) {
+			throw std::runtime_error("Image is not a portable arbitrary map.");
+		}
+
+		const auto skip_to_eol =
+			[&stream]()
+			{
+				char c;
+
+				while (stream.get(c)) {
+					if (c == '\n') {
+						break;
+					}
+				}
+			};
+
+		const auto skip_ws =
+			[&stream]()
+			{
+				char c;
+
+				while (stream.get(c)) {
+					if (
+						c != '\t'
+						&& c != '\r'
+						&& c != ' '
+					) {
+						stream.unget();
+						break;
+					}
+				}
+			};
+
+		std::size_t width = 0;
+		std::size_t height = 0;
+		std::size_t depth = 0;
+		std::size_t max_value = 0;
+		std::string tuple_type;
+		bool endhdr = false;
+
+		while (stream.get(c)) {
+			if (c == '#') {
+				skip_to_eol();
+				continue;
+			}
+
+			stream.unget();
+
+			skip_ws();
+
+			std::string token;
+
+			if (!(stream >> token)) {
+				throw std::runtime_error("Malformed PAM image header.");
+			}
+
+			const auto assign =
+				[&stream, &skip_to_eol, &skip_ws](auto& out)
+				{
+					skip_ws();
+
+					if (!(stream >> out)) {
+						throw std::runtime_error("Malformed PAM image header.");
+					}
+
+					skip_to_eol();
+				};
+
+			if (token == "WIDTH") {
+				assign(width);
+			}
+			else if (token == "HEIGHT") {
+				assign(height);
+			}
+			else if (token == "DEPTH") {
+				assign(depth);
+			}
+			else if (token == "MAXVAL") {
+				assign(max_value);
+			}
+			else if (token == "TUPLTYPE") {
+				assign(tuple_type);
+			}
+			else if (token == "ENDHDR") {
+				endhdr = true;
+				skip_to_eol();
+
+				break;
+			}
+			else {
+				skip_to_eol();
+			}
+		}
+
+		if (!endhdr || !width || !height) {
+			throw std::runtime_error("Malformed PAM image header.");
+		}
+
+		if (
+			max_value != 255
+			|| (
+				(
+					depth != 3
+					|| (
+						tuple_type != "RGB"
+						&& !any_tuple_type
+					)
+				)
+				&& (
+					depth != 4
+					|| (
+						tuple_type != "RGB_ALPHA"
+						&& !any_tuple_type
+					)
+				)
+			)
+		) {
+			throw std::runtime_error("Unsupported PAM format.");
+		}
+
+		return {width, height, depth};
+	}
+
+	// Deinterleaves `width` tuples with `Depth` channels. The swizzle is
+	// a matter of which byte goes where, so it comes at no extra cost.
+	template<std::size_t Depth, bool Bgr>
+	void convertPamTuples(const char* line, std::size_t width, Image::Pixel* pixels)
+	{
+		const unsigned char* const tuples = reinterpret_cast<const unsigned char*>(line);
+
+		constexpr int r = Bgr ? 2 : 0;
+		constexpr int b = Bgr ? 0 : 2;
+
+		std::size_t x = 0;
+
+#if defined(__SSSE3__)
+		// Four pixels at a time: A single shuffle puts the channels in
+		// place, and for RGB tuples leaves room for the opaque alpha
+		const __m128i shuffle =
+			Depth == 4
+				? _mm_setr_epi8(r, 1, b, 3, r + 4, 5, b + 4, 7, r + 8, 9, b + 8, 11, r + 12, 13, b + 12, 15)
+				: _mm_setr_epi8(r, 1, b, -1, r + 3, 4, b + 3, -1, r + 6, 7, b + 6, -1, r + 9, 10, b + 9, -1);
+		const __m128i alpha =
+			Depth == 4
+				? _mm_setzero_si128()
+				: _mm_set1_epi32(static_cast<int>(0xFF000000));
+
+		// RGB reads 16 bytes for 12, so it stops before the line end
+		for (; x + (Depth == 4 ? 4 : 6) <= width; x += 4) {
+			const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tuples + x * Depth));
+
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + x), _mm_or_si128(_mm_shuffle_epi8(input, shuffle), alpha));
+		}
+#endif
+
+		for (; x < width; ++x) {
+			const unsigned char* const tuple = tuples + x * Depth;
+
+			pixels[x] = {
+				tuple[r],
+				tuple[1],
+				tuple[b],
+				Depth == 4 ? tuple[3] : Image::Pixel::Value(255)
+			};
+		}
+	}
+
+	// Deinterleaves one line of PAM tuples into `width` pixels
+	inline void convertPamLine(const char* line, std::size_t depth, std::size_t width, Image::Pixel* pixels, Swizzle swizzle = Swizzle::RGBA)
+	{
+		if (depth == 4) {
+			if (swizzle == Swizzle::BGRA) {
+				convertPamTuples<4, true>(line, width, pixels);
+			} else {
+				convertPamTuples<4, false>(line, width, pixels);
+			}
+		}
+		else {
+			if (swizzle == Swizzle::BGRA) {
+				convertPamTuples<3, true>(line, width, pixels);
+			} else {
+				convertPamTuples<3, false>(line, width, pixels);
+			}
+		}
+	}
+
+	// Converts the alpha of `count` pixels in place, right after
+	// convertPamLine() while they are still in the cache. The loops have
+	// no branches, so the compiler can vectorize them.
+	inline void convertAlpha(Image::Pixel* pixels, std::size_t count, Alpha alpha)
+	{
+		switch (alpha) {
+			case Alpha::KEEP: {
+				break;
+			}
+
+			case Alpha::PREMULTIPLY: {
+				for (std::size_t i = 0; i < count; ++i) {
+					Image::Pixel& pixel = pixels[i];
+
+					const auto multiply =
+						[a = pixel.a](Image::Pixel::Value value) -> Image::Pixel::Value
+						{
+							// value * a / 255, rounded, without dividing
+							const unsigned int product = value * a + 128;
+							return (product + (product >> 8)) >> 8;
+						};
+
+					pixel.r = multiply(pixel.r);
+					pixel.g = multiply(pixel.g);
+					pixel.b = multiply(pixel.b);
+				}
+
+				break;
+			}
+
+			case Alpha::UNPREMULTIPLY: {
+				for (std::size_t i = 0; i < count; ++i) {
+					Image::Pixel& pixel = pixels[i];
+
+					const float factor = pixel.a ? 255.0f / pixel.a : 0.0f;
+
+					const auto divide =
+						[factor](Image::Pixel::Value value) -> Image::Pixel::Value
+						{
+							return std::min(255.0f, value * factor + 0.5f);
+						};
+
+					pixel.r = divide(pixel.r);
+					pixel.g = divide(pixel.g);
+					pixel.b = divide(pixel.b);
+				}
+
+				break;
+			}
+		}
+	}
+
+	// `hash`, if given, is fed with the dimensions and then the body as it
+	// is read, so it identifies the PAM without keeping it around
+	inline Image readPam(std::istream& stream, const ReadOptions& options = {}, XxHash64* hash = nullptr)
+	{
+		Image res;
+
+		const auto [width, height, depth] = readPamHeader(stream, options.swizzle != Swizzle::RGBA);
+
+		PAM2QOI_PROBE3(header__parsed, width, height, depth);
+
+		if (hash) {
+			for (const std::uint64_t value : {width, height, depth}) {
+				hash->update(&value, sizeof(value));
+			}
+		}
+
+		// Checked before anything is allocated, so a crafted header can't
+		// make us allocate unbounded memory
+		if (
+			height > std::numeric_limits<std::size_t>::max() / 4 / width
+			|| (
+				options.max_pixels
+				&& width * height > options.max_pixels
+			)
+		) {
+			throw std::runtime_error("PAM image exceeds the pixel limit.");
+		}
+
+		std::size_t scale = std::max<std::size_t>(1, options.scale);
+
+		if (options.fit_width && options.fit_height) {
+			scale = std::max({
+				scale,
+				(width + options.fit_width - 1) / options.fit_width,
+				(height + options.fit_height - 1) / options.fit_height
+			});
+		}
+
+		std::vector<char> line_buffer;
+
+		{
+			const AllocationScope scope(AllocationSite::LINE_BUFFER);
+			line_buffer.resize(depth * width);
+		}
+
+		const auto read_line =
+			[&stream, &line_buffer, hash]()
+			{
+				stream.read(line_buffer.data(), line_buffer.size());
+
+				if (!stream) {
+					throw std::runtime_error("Corrupt PAM image body.");
+				}
+
+				if (hash) {
+					hash->update(line_buffer.data(), line_buffer.size());
+				}
+			};
+
+		if (scale == 1) {
+			res.clearAndInitialize(width, height);
+
+			for (std::size_t y = 0; y < height; ++y) {
+				read_line();
+
+				Image::Pixel* const row = res.getRow(y);
+
+				convertPamLine(line_buffer.data(), depth, width, row, options.swizzle);
+				convertAlpha(row, width, options.alpha);
+			}
+
+			return res;
+		}
+
+		// Downscaling sums up every `scale` x `scale` box while the lines
+		// come in, so only the averaged pixels are ever stored in `res`.
+		// Boxes at the right and bottom border may be smaller. The boxes
+		// are always averaged premultiplied, so the colors of transparent
+		// pixels don't bleed into their neighbours. Straight colors are
+		// weighted by alpha and divided by the alpha sum, which is
+		// premultiplying and unpremultiplying in one go.
+		const std::size_t scaled_width = (width + scale - 1) / scale;
+		const std::size_t scaled_height = (height + scale - 1) / scale;
+
+		res.clearAndInitialize(scaled_width, scaled_height);
+
+		const bool weighted = options.alpha == Alpha::KEEP;
+
+		std::vector<Image::Pixel> pixel_line(width);
+		std::vector<std::uint64_t> sums(scaled_width * 4);
+
+		for (std::size_t y = 0; y < height; ++y) {
+			read_line();
+
+			convertPamLine(line_buffer.data(), depth, width, pixel_line.data(), options.swizzle);
+
+			if (options.alpha == Alpha::PREMULTIPLY) {
+				convertAlpha(pixel_line.data(), width, Alpha::PREMULTIPLY);
+			}
+
+			for (std::size_t x = 0; x < width; ++x) {
+				std::uint64_t* const sum = &sums[x / scale * 4];
+				const Image::Pixel& pixel = pixel_line[x];
+				const std::uint64_t weight = weighted ? pixel.a : 1;
+
+				sum[0] += pixel.r * weight;
+				sum[1] += pixel.g * weight;
+				sum[2] += pixel.b * weight;
+				sum[3] += pixel.a;
+			}
+
+			if ((y + 1) % scale != 0 && y + 1 != height) {
+				continue;
+			}
+
+			const std::size_t box_height = y % scale + 1;
+
+			for (std::size_t scaled_x = 0; scaled_x < scaled_width; ++scaled_x) {
+				const std::uint64_t count = std::min(scale, width - scaled_x * scale) * box_height;
+				const std::uint64_t* const sum = &sums[scaled_x * 4];
+
+				const auto average =
+					[](std::uint64_t value, std::uint64_t count) -> Image::Pixel::Value
+					{
+						// A fully transparent box has no color
+						return count ? (value + count / 2) / count : 0;
+					};
+
+				const std::uint64_t color_count = weighted ? sum[3] : count;
+
+				res.setPixel(
+					scaled_x,
+					y / scale,
+					{
+						average(sum[0], color_count),
+						average(sum[1], color_count),
+						average(sum[2], color_count),
+						average(sum[3], count)
+					}
+				);
+			}
+
+			if (options.alpha == Alpha::UNPREMULTIPLY) {
+				convertAlpha(res.getRow(y / scale), scaled_width, Alpha::UNPREMULTIPLY);
+			}
+
+			std::fill(sums.begin(), sums.end(), 0);
+		}
+
+		return res;
+	}
+
+}
@@ -22,435 +22,976 @@
  */
 
 #include <algorithm>
-#include <array>
+#include <atomic>
 #include <chrono>
 #include <cstdint>
-#include <functional>
+#include <cstdlib>
+#include <fstream>
 #include <future>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <new>
 #include <optional>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "allocations.h"
+#include "cache.h"
+#include "counters.h"
+#include "hash.h"
+#include "image.h"
+#include "pam.h"
+#include "probes.h"
+#include "qoi.h"
+#include "readahead.h"
+#include "stripes.h"
+
+using namespace pam2qoi;
+
+// Counts the allocations by site for --memory. The array, nothrow and
+// sized variants all end up here. Kept out of line, as GCC would
+// otherwise see a new paired with free() and warn about the mismatch.
+__attribute__((noinline)) void* operator new(std::size_t size)
+{
+	AllocationScope::count(size);
+
+	if (void* const res = std::malloc(size ? size : 1)) {
+		return res;
+	}
+
+	throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* pointer) noexcept
+{
+	std::free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void* pointer, std::size_t) noexcept
+{
+	std::free(pointer);
+}
+
 namespace
 {
 
-	class Image final
+	struct Options {
+		ReadOptions read;
+		EncodeOptions encode;
+		std::optional<unsigned long> threads;
+		// Defaults to one per thread
+		std::optional<std::size_t> stripes;
+		// Stripes of a fixed number of lines instead
+		std::optional<std::size_t> stripe_lines;
+		// Decode the produced QOI and compare it to the image
+		bool verify = false;
+		// Encode the stripes from a guessed index and repair them
+		bool speculative = false;
+		// Directory of previously encoded images
+		std::optional<std::string> cache;
+		// CRC32C of the QOI to STDERR and optionally to a file
+		bool checksum = false;
+		std::optional<std::string> checksum_file;
+		// Stripes not started by then use the fast effort
+		std::optional<std::chrono::milliseconds> deadline;
+		// Hardware counters of reading, encoding and each stripe thread
+		bool counters = false;
+		// Peak RSS of reading and encoding, and the allocations by site
+		bool memory = false;
+		// Encode at 1, 2, 4, ... threads instead of writing the QOI
+		bool bench_scaling = false;
+		// Read a file with O_DIRECT or drop it from the page cache
+		bool uncached = false;
+	};
+
+	Options parseOptions(int argc, char** argv)
 	{
-	public:
-		struct alignas(std::uint32_t) Pixel {
-			using Value = std::uint8_t;
+		Options res;
 
-			Value r = 0;
-			Value g = 0;
-			Value b = 0;
-			Value a = 255;
+		for (int i = 1; i < argc; ++i) {
+			const std::string arg = argv[i];
 
-			bool operator ==(const Pixel& other) const
-			{
-				return
-					r == other.r
-					&& g == other.g
-					&& b == other.b
-					&& a == other.a;
+			if (arg.compare(0, 2, "--") != 0) {
+				res.threads = std::stoul(arg);
+				continue;
 			}
-		};
 
-		Image() :
-			width_(0),
-			height_(0)
-		{
+			const std::string::size_type equals = arg.find('=');
+			const std::string name = arg.substr(0, equals);
+
+			const auto value =
+				[&]() -> std::string
+				{
+					if (equals != std::string::npos) {
+						return arg.substr(equals + 1);
+					}
+
+					if (i + 1 < argc) {
+						return argv[++i];
+					}
+
+					throw std::runtime_error("Missing value for option " + name + ".");
+				};
+
+			if (name == "--verify") {
+				res.verify = true;
+			}
+			else if (name == "--stripes") {
+				res.stripes = std::stoull(value());
+
+				if (!*res.stripes) {
+					throw std::runtime_error("There must be at least one stripe.");
+				}
+			}
+			else if (name == "--stripe-lines") {
+				res.stripe_lines = std::stoull(value());
+
+				if (!*res.stripe_lines) {
+					throw std::runtime_error("Stripes must have at least one line.");
+				}
+			}
+			else if (name == "--checksum") {
+				res.checksum = true;
+			}
+			else if (name == "--checksum-file") {
+				res.checksum = true;
+				res.checksum_file = value();
+			}
+			else if (name == "--deadline-ms") {
+				res.deadline = std::chrono::milliseconds(std::stoull(value()));
+			}
+			else if (name == "--uncached") {
+				res.uncached = true;
+			}
+			else if (name == "--bench-scaling") {
+				res.bench_scaling = true;
+			}
+			else if (name == "--memory") {
+				res.memory = true;
+			}
+			else if (name == "--counters") {
+				res.counters = true;
+			}
+			else if (name == "--cache") {
+				res.cache = value();
+			}
+			else if (name == "--speculative") {
+				res.speculative = true;
+			}
+			else if (name == "--warm-up") {
+				res.encode.warm_up = std::stoull(value());
+			}
+			else if (name == "--max-pixels") {
+				res.read.max_pixels = std::stoull(value());
+			}
+			else if (name == "--premultiply") {
+				res.read.alpha = Alpha::PREMULTIPLY;
+			}
+			else if (name == "--unpremultiply") {
+				res.read.alpha = Alpha::UNPREMULTIPLY;
+			}
+			else if (name == "--swizzle") {
+				const std::string swizzle = value();
+
+				if (swizzle == "rgba") {
+					res.read.swizzle = Swizzle::RGBA;
+				}
+				else if (swizzle == "bgra") {
+					res.read.swizzle = Swizzle::BGRA;
+				}
+				else {
+					throw std::runtime_error("Swizzle must be rgba or bgra.");
+				}
+			}
+			else if (name == "--effort") {
+				const std::string effort = value();
+
+				if (effort == "fast") {
+					res.encode.effort = Effort::FAST;
+				}
+				else if (effort == "normal") {
+					res.encode.effort = Effort::NORMAL;
+				}
+				else {
+					throw std::runtime_error("Effort must be fast or normal.");
+				}
+			}
+			else if (name == "--near-lossless") {
+				res.encode.near_lossless = std::stoul(value());
+			}
+			else if (name == "--colorspace") {
+				const std::string colorspace = value();
+
+				if (colorspace == "srgb") {
+					res.encode.colorspace = Colorspace::SRGB;
+				}
+				else if (colorspace == "linear") {
+					res.encode.colorspace = Colorspace::LINEAR;
+				}
+				else {
+					throw std::runtime_error("Colorspace must be srgb or linear.");
+				}
+			}
+			else if (name == "--scale") {
+				const std::string scale = value();
+
+				if (scale.compare(0, 2, "1/") != 0) {
+					throw std::runtime_error("Scale must be given as 1/N.");
+				}
+
+				res.read.scale = std::stoul(scale.substr(2));
+
+				if (!res.read.scale) {
+					throw std::runtime_error("Scale must be given as 1/N.");
+				}
+			}
+			else if (name == "--fit") {
+				const std::string fit = value();
+				const std::string::size_type x = fit.find('x');
+
+				if (x == std::string::npos) {
+					throw std::runtime_error("Fit must be given as WxH.");
+				}
+
+				res.read.fit_width = std::stoul(fit.substr(0, x));
+				res.read.fit_height = std::stoul(fit.substr(x + 1));
+
+				if (!res.read.fit_width || !res.read.fit_height) {
+					throw std::runtime_error("Fit must be given as WxH.");
+				}
+			}
+			else {
+				throw std::runtime_error("Unknown option " + name + ".");
+			}
 		}
 
-		Image(Image&& other) noexcept :
-			width_(other.width_),
-			height_(other.height_),
-			pixels_(std::move(other.pixels_))
-		{
+		if (res.stripes && res.stripe_lines) {
+			throw std::runtime_error("Only one of --stripes and --stripe-lines can be given.");
 		}
 
-		Image& operator =(Image&& other)
-		{
-			if (this != &other) {
-				width_ = other.width_;
-				height_ = other.height_;
+		return res;
+	}
 
-				pixels_ = std::move(other.pixels_);
+	std::string toHex(std::uint64_t value, int digits = 16)
+	{
+		std::ostringstream res;
+		res << std::hex << std::setw(digits) << std::setfill('0') << value;
+		return res.str();
+	}
+
+	// The indices of the set `flags` as "0, 3-5"
+	std::string describeRanges(const std::vector<char>& flags)
+	{
+		std::string res;
+
+		for (std::size_t i = 0; i < flags.size(); ++i) {
+			if (!flags[i]) {
+				continue;
 			}
 
-			return *this;
-		}
+			const std::size_t first = i;
 
-		explicit operator bool() const
-		{
-			return width_ && height_;
+			while (i + 1 < flags.size() && flags[i + 1]) {
+				++i;
+			}
+
+			res += (res.empty() ? "" : ", ") + std::to_string(first);
+
+			if (i > first) {
+				res += "-" + std::to_string(i);
+			}
 		}
 
-		void clearAndInitialize(std::size_t width, std::size_t height)
-		{
-			width_ = width;
-			height_ = height;
+		return res;
+	}
+
+	// "1.52 IPC, 20.1 cycles, 0.031 branch misses, 0.002 LLC misses per
+	// pixel", leaving out what's missing
+	std::string describeCounters(const CounterValues& values, std::size_t pixels)
+	{
+		std::ostringstream res;
+		res << std::fixed;
 
-			pixels_.assign(width * height, {});
-			pixels_.shrink_to_fit();
+		if (values.cycles && values.instructions && *values.cycles) {
+			res << std::setprecision(2) << static_cast<double>(*values.instructions) / *values.cycles << " IPC, ";
 		}
 
-		std::size_t getWidth() const
-		{
-			return width_;
+		const std::pair<const std::optional<std::uint64_t>&, const char*> per_pixel[] = {
+			{values.cycles, "cycles"},
+			{values.branch_misses, "branch misses"},
+			{values.llc_misses, "LLC misses"}
+		};
+
+		bool any = false;
+
+		for (const auto& [value, name] : per_pixel) {
+			if (value) {
+				res << (any ? ", " : "") << std::setprecision(3) << static_cast<double>(*value) / std::max<std::size_t>(pixels, 1) << " " << name;
+				any = true;
+			}
 		}
 
-		std::size_t getHeight() const
-		{
-			return height_;
+		if (any) {
+			res << " per pixel";
 		}
 
-		Pixel getPixel(std::size_t x, std::size_t y) const
+		return res.str();
+	}
+
+	// Sums up the hardware counters of the stripes by the thread that ran
+	// them. Each thread opens its counters once.
+	class StripeCounters final
+	{
+	public:
+		struct Thread {
+			std::size_t stripes = 0;
+			std::size_t pixels = 0;
+			CounterValues values;
+		};
+
+		template<typename Task>
+		auto count(std::size_t pixels, const Task& task) -> decltype(task())
 		{
-			if (x < width_ && y < height_) {
-				return pixels_[width_ * y + x];
+			thread_local PerfCounters counters;
+
+			counters.start();
+			auto res = task();
+			const CounterValues values = counters.stop();
+
+			const std::lock_guard<std::mutex> lock(mutex_);
+
+			const auto [iterator, inserted] = indices_.emplace(std::this_thread::get_id(), threads_.size());
+
+			if (inserted) {
+				threads_.push_back({0, 0, values});
 			}
+			else {
+				threads_[iterator->second].values += values;
+			}
+
+			Thread& thread = threads_[iterator->second];
+			++thread.stripes;
+			thread.pixels += pixels;
 
-			return {};
+			return res;
 		}
 
-		void setPixel(std::size_t x, std::size_t y, const Pixel& value)
+		// In the order the threads ran their first stripe
+		const std::vector<Thread>& getThreads() const
 		{
-			if (x < width_ && y < height_) {
-				pixels_[width_ * y + x] = value;
-			}
+			return threads_;
 		}
 
 	private:
-		std::size_t width_;
-		std::size_t height_;
-
-		std::vector<Pixel> pixels_;
+		std::mutex mutex_;
+		std::map<std::thread::id, std::size_t> indices_;
+		std::vector<Thread> threads_;
 	};
 
-	Image readPam(std::istream& stream)
+	std::string describeBytes(std::uint64_t bytes)
+	{
+		std::ostringstream res;
+		res << std::fixed << std::setprecision(1);
+
+		if (bytes < 1024 * 1024) {
+			res << bytes / 1024.0 << " KiB";
+		}
+		else {
+			res << bytes / (1024.0 * 1024.0) << " MiB";
+		}
+		return res.str();
+	}
+
+	// Encodes `image` at 1, 2, 4, ... and `max_threads` threads, in one
+	// stripe per thread unless the stripes are given, and reports the
+	// speedup over one thread. The serial fraction is fitted to Amdahl's
+	// law, T(n) = T(1) * (s + (1 - s) / n), and the time spent joining
+	// the stripes in order, which can't scale, is given separately.
+	void benchmarkScaling(const Image& image, const Options& options, unsigned int max_threads)
 	{
-		Image res;
+		using Clock = std::chrono::steady_clock;
 
-		char c;
+		std::vector<unsigned int> counts;
 
-		if (
-			!stream.get(c)
-			|| c != 'P'
-			|| !stream.get(c)
-			|| c != '7'
-			|| !stream.get(c)
-			|| c != '\n'
-		) {
-			throw std::runtime_error("Image is not a portable arbitrary map.");
+		for (unsigned int threads = 1; threads < max_threads; threads *= 2) {
+			counts.push_back(threads);
 		}
 
-		const auto skip_to_eol =
-			[&stream]()
-			{
-				char c;
+		counts.push_back(max_threads);
 
-				while (stream.get(c)) {
-					if (c == '\n') {
-						break;
-					}
-				}
+		const auto to_ms =
+			[](Clock::duration duration) -> double
+			{
+				return std::chrono::duration<double, std::milli>(duration).count();
 			};
 
-		const auto skip_ws =
-			[&stream]()
-			{
-				char c;
-
-				while (stream.get(c)) {
-					if (
-						c != '\t'
-						&& c != '\r'
-						&& c != ' '
-					) {
-						stream.unget();
-						break;
+		std::cerr << "Scaling: threads    time ms  speedup  efficiency  concatenation ms" << std::endl;
+
+		double time_1 = 0;
+		// For the least squares fit of s
+		double sum_xy = 0;
+		double sum_xx = 0;
+
+		for (const unsigned int threads : counts) {
+			const std::vector<Stripe> stripes =
+				options.stripe_lines
+					? layoutStripeLines(image.getWidth(), image.getHeight(), *options.stripe_lines)
+					: layoutStripes(image.getWidth(), image.getHeight(), options.stripes ? *options.stripes : threads);
+
+			// The best of five runs
+			Clock::duration best = Clock::duration::max();
+			Clock::duration best_concatenation(0);
+
+			for (unsigned int run = 0; run < 5; ++run) {
+				std::string output;
+				Clock::duration concatenation(0);
+
+				const Clock::time_point start = Clock::now();
+
+				runStripes(
+					stripes.size(),
+					threads,
+					[&image, &options, &stripes](std::size_t i) -> std::string
+					{
+						return encodeQoi(image, stripes[i], options.encode);
+					},
+					[&output, &concatenation](std::size_t, std::string&& data)
+					{
+						const Clock::time_point start = Clock::now();
+						output += data;
+						concatenation += Clock::now() - start;
 					}
+				);
+
+				const Clock::duration time = Clock::now() - start;
+
+				if (time < best) {
+					best = time;
+					best_concatenation = concatenation;
 				}
-			};
+			}
+
+			if (threads == 1) {
+				time_1 = to_ms(best);
+			}
 
-		std::size_t width;
-		std::size_t height;
-		std::size_t depth;
-		std::size_t max_value;
-		std::string tuple_type;
-		bool endhdr = false;
+			const double speedup = time_1 / to_ms(best);
 
-		while (stream.get(c)) {
-			if (c == '#') {
-				skip_to_eol();
-				continue;
+			if (threads > 1) {
+				const double x = 1 - 1.0 / threads;
+				const double y = to_ms(best) / time_1 - 1.0 / threads;
+				sum_xy += x * y;
+				sum_xx += x * x;
 			}
 
-			stream.unget();
+			std::cerr << std::fixed << std::setprecision(2)
+				<< "Scaling: " << std::setw(7) << threads
+				<< std::setw(11) << to_ms(best)
+				<< std::setw(9) << speedup
+				<< std::setw(11) << speedup / threads * 100 << "%"
+				<< std::setw(18) << to_ms(best_concatenation) << std::endl;
+		}
 
-			skip_ws();
+		if (sum_xx > 0) {
+			const double serial = sum_xy / sum_xx;
 
-			std::string token;
+			std::cerr << "Scaling: serial fraction " << std::setprecision(1) << serial * 100 << "%";
 
-			if (!(stream >> token)) {
-				throw std::runtime_error("Malformed PAM image header.");
+			if (serial > 0 && serial < 1) {
+				std::cerr << ", at most " << std::setprecision(2) << 1 / serial << "x faster with any number of threads";
 			}
 
-			const auto assign =
-				[&stream, &skip_to_eol, &skip_ws](auto& out)
-				{
-					skip_ws();
+			std::cerr << std::endl;
+		}
+		else {
+			std::cerr << "Scaling: a serial fraction needs more than one thread" << std::endl;
+		}
+	}
 
-					if (!(stream >> out)) {
-						throw std::runtime_error("Malformed PAM image header.");
-					}
+	struct EncodedStripe {
+		std::string data;
+		// CRC32C of `data` with --checksum
+		std::uint32_t checksum = 0;
+	};
 
-					skip_to_eol();
-				};
+	// The lines [first, end) that `stripe` touches, as the probes give
+	// them
+	std::pair<std::size_t, std::size_t> getStripeLines(const Stripe& stripe, std::size_t width)
+	{
+		return {stripe.begin / width, (stripe.end + width - 1) / width};
+	}
 
-			if (token == "WIDTH") {
-				assign(width);
-			}
-			else if (token == "HEIGHT") {
-				assign(height);
-			}
-			else if (token == "DEPTH") {
-				assign(depth);
-			}
-			else if (token == "MAXVAL") {
-				assign(max_value);
+	// How reading went, for the report
+	struct ReadStatistics {
+		std::optional<ReadAheadBuffer::Statistics> read_ahead;
+		// How --uncached read the file, if it did
+		const char* uncached_mode = nullptr;
+		// By how much the system's page cache grew meanwhile, which
+		// includes other processes
+		std::optional<std::int64_t> page_cache_change;
+	};
+
+	// Reads the PAM from STDIN, a pipe with a thread reading ahead, and a
+	// file with --uncached past the page cache
+	Image readImage(const Options& options, XxHash64* hash, ReadStatistics& statistics)
+	{
+		struct stat status;
+
+		// The kernel reads ahead a pipe only as far as its capacity, so a
+		// thread does while readPam() converts
+		if (fstat(STDIN_FILENO, &status) == 0 && (S_ISFIFO(status.st_mode) || S_ISSOCK(status.st_mode))) {
+			ReadAheadBuffer read_ahead(STDIN_FILENO);
+			std::istream stream(&read_ahead);
+			stream.exceptions(std::ios::badbit);
+
+			Image res = readPam(stream, options.read, hash);
+
+			statistics.read_ahead = read_ahead.getStatistics();
+
+			return res;
+		}
+
+		if (options.uncached && fstat(STDIN_FILENO, &status) == 0 && S_ISREG(status.st_mode)) {
+			const FileDescriptor direct = openDirect(STDIN_FILENO);
+
+			statistics.uncached_mode = direct ? "O_DIRECT" : "POSIX_FADV_DONTNEED";
+
+			const std::optional<std::uint64_t> page_cache_before = getPageCacheSize();
+
+			Image res;
+
+			{
+				ReadAheadBuffer read_ahead(direct ? direct.get() : STDIN_FILENO, 8 * 1024 * 1024, true);
+				std::istream stream(&read_ahead);
+				stream.exceptions(std::ios::badbit);
+
+				res = readPam(stream, options.read, hash);
+
+				statistics.read_ahead = read_ahead.getStatistics();
 			}
-			else if (token == "TUPLTYPE") {
-				assign(tuple_type);
+
+			const std::optional<std::uint64_t> page_cache_after = getPageCacheSize();
+
+			if (page_cache_before && page_cache_after) {
+				statistics.page_cache_change = static_cast<std::int64_t>(*page_cache_after - *page_cache_before);
 			}
-			else if (token == "ENDHDR") {
-				endhdr = true;
-				skip_to_eol();
 
-				break;
+			return res;
+		}
+
+		return readPam(std::cin, options.read, hash);
+	}
+
+	// The input's hash and anything else that changes the QOI, down to
+	// the stripe borders
+	std::string getCacheKey(const Options& options, const std::vector<Stripe>& stripes, const XxHash64& input_hash)
+	{
+		XxHash64 settings;
+
+		const auto add =
+			[&settings](std::uint64_t value)
+			{
+				settings.update(&value, sizeof(value));
+			};
+
+		add(options.read.scale);
+		add(options.read.fit_width);
+		add(options.read.fit_height);
+		add(static_cast<std::uint64_t>(options.read.alpha));
+		add(static_cast<std::uint64_t>(options.read.swizzle));
+		add(static_cast<std::uint64_t>(options.encode.colorspace));
+		add(static_cast<std::uint64_t>(options.encode.effort));
+		add(options.encode.warm_up);
+		add(options.encode.near_lossless);
+		add(options.speculative);
+
+		for (const Stripe& stripe : stripes) {
+			add(stripe.begin);
+			add(stripe.end);
+		}
+
+		return toHex(input_hash.digest()) + "-" + toHex(settings.digest());
+	}
+
+	// Writes the QOI to STDOUT stripe by stripe, and keeps a copy for the
+	// cache and combines the checksums if asked to
+	class Output final
+	{
+	public:
+		Output(bool keep, bool checksum) :
+			keep_(keep),
+			checksum_enabled_(checksum),
+			checksum_(0),
+			written_(0)
+		{
+		}
+
+		void write(const EncodedStripe& stripe)
+		{
+			std::cout << stripe.data;
+			written_ += stripe.data.size();
+
+			if (keep_) {
+				data_ += stripe.data;
 			}
-			else {
-				skip_to_eol();
+
+			if (checksum_enabled_) {
+				checksum_ = combineCrc32c(checksum_, stripe.checksum, stripe.data.size());
 			}
 		}
 
-		if (!endhdr) {
-			throw std::runtime_error("Malformed PAM image header.");
+		// Empty unless kept
+		const std::string& getData() const
+		{
+			return data_;
 		}
 
-		if (
-			max_value != 255
-			|| (
-				(
-					depth != 3
-					|| tuple_type != "RGB"
-				)
-				&& (
-					depth != 4
-					|| tuple_type != "RGB_ALPHA"
-				)
-			)
-		) {
-			throw std::runtime_error("Unsupported PAM format.");
+		// The stripes' checksums combined in order
+		std::uint32_t getChecksum() const
+		{
+			return checksum_;
 		}
 
-		res.clearAndInitialize(width, height);
+		std::size_t getWritten() const
+		{
+			return written_;
+		}
 
-		std::vector<char> line_buffer(depth * width);
+	private:
+		const bool keep_;
+		const bool checksum_enabled_;
+		std::string data_;
+		std::uint32_t checksum_;
+		std::size_t written_;
+	};
 
-		for (std::size_t y = 0; y < height; ++y) {
-			stream.read(line_buffer.data(), depth * width);
+	// What the ways of encoding share: The options of each stripe, and
+	// verifying, checksumming and counting a stripe in the thread that
+	// encoded it
+	class Encoding final
+	{
+	public:
+		Encoding(const Image& image, const Options& options, const std::vector<Stripe>& stripes, std::chrono::steady_clock::time_point cutoff) :
+			image_(image),
+			options_(options),
+			stripes_(stripes),
+			cutoff_(cutoff),
+			degraded_(stripes.size(), 0),
+			verify_time_(0)
+		{
+		}
+
+		const Image& getImage() const
+		{
+			return image_;
+		}
+
+		const Options& getOptions() const
+		{
+			return options_;
+		}
+
+		const std::vector<Stripe>& getStripes() const
+		{
+			return stripes_;
+		}
 
-			if (!stream) {
-				throw std::runtime_error("Corrupt PAM image body.");
+		// Stripes not started by the deadline use the fast effort
+		EncodeOptions getEncodeOptions(std::size_t i)
+		{
+			EncodeOptions res = options_.encode;
+
+			if (options_.deadline && std::chrono::steady_clock::now() >= cutoff_) {
+				res.effort = Effort::FAST;
+				res.near_lossless = 0;
+				degraded_[i] = 1;
 			}
 
-			std::vector<char>::size_type index = 0;
+			return res;
+		}
 
-			for (std::size_t x = 0; x < width; ++x) {
-				Image::Pixel pixel;
+		// Runs `task` for stripe `i`, counted with --counters
+		template<typename Task>
+		auto count(std::size_t i, const Task& task) -> decltype(task())
+		{
+			if (options_.counters) {
+				return counters_.count(stripes_[i].end - stripes_[i].begin, task);
+			}
 
-				for (unsigned int p = 0; p < depth; ++p, ++index) {
-					switch (p) {
-						case 0: {
-							pixel.r = line_buffer[index];
-							break;
-						}
+			return task();
+		}
 
-						case 1: {
-							pixel.g = line_buffer[index];
-							break;
-						}
+		void verify(const std::string& data, const Stripe& stripe)
+		{
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-						case 2: {
-							pixel.b = line_buffer[index];
-							break;
-						}
+			verifyQoi(image_, data, stripe.begin, stripe.end, options_.encode.near_lossless);
 
-						case 3: {
-							pixel.a = line_buffer[index];
-							break;
-						}
-					}
-				}
+			verify_time_ += (std::chrono::steady_clock::now() - start).count();
+		}
 
-				res.setPixel(x, y, pixel);
+		// Verifies and checksums stripe `i` right away, while it's still
+		// in the cache, instead of another pass over the whole QOI
+		EncodedStripe finish(std::size_t i, std::string&& data)
+		{
+			if (options_.verify) {
+				verify(data, stripes_[i]);
 			}
-		}
 
-		return res;
-	}
+			const std::uint32_t checksum = options_.checksum ? crc32c(data.data(), data.size()) : 0;
 
-	std::string encodeQoi(
-		const Image& image,
-		std::size_t start_y,
-		std::size_t end_y
-	)
-	{
-		enum class Tag : std::uint8_t {
-			INDEX = 0x00,
-			DIFF = 0x40,
-			LUMA = 0x80,
-			RUN = 0xC0,
-			LONG_RUN = 0xFD,
-			RGB = 0xFE,
-			RGBA = 0xFF
-		};
+			return {std::move(data), checksum};
+		}
 
-		std::string res;
-		res.reserve((end_y - start_y) * image.getWidth() * 4 * 2 / 3);
+		// Which stripes started past the deadline
+		const std::vector<char>& getDegraded() const
+		{
+			return degraded_;
+		}
 
-		if (start_y == 0) {
-			// Header
-			const auto encode_be =
-				[&res](std::uint32_t value)
-				{
-					res.push_back(value >> 24);
-					res.push_back(value >> 16);
-					res.push_back(value >> 8);
-					res.push_back(value);
-				};
+		// In all stripes
+		std::chrono::steady_clock::duration getVerifyTime() const
+		{
+			return std::chrono::steady_clock::duration(verify_time_);
+		}
 
-			res += "qoif";
-			encode_be(image.getWidth());
-			encode_be(image.getHeight());
-			res.push_back(4);
-			res.push_back(0);
+		const StripeCounters& getCounters() const
+		{
+			return counters_;
 		}
 
-		// Body
-		std::array<std::optional<Image::Pixel>, 64> index;
+	private:
+		const Image& image_;
+		const Options& options_;
+		const std::vector<Stripe>& stripes_;
+		const std::chrono::steady_clock::time_point cutoff_;
+		std::vector<char> degraded_;
+		std::atomic<std::chrono::steady_clock::duration::rep> verify_time_;
+		StripeCounters counters_;
+	};
+
+	// The QOI of an earlier run, checked against the image with --verify
+	void writeCached(Encoding& encoding, std::string&& cached, Output& output)
+	{
+		const Image& image = encoding.getImage();
 
-		if (start_y == 0) {
-			index.fill(Image::Pixel{0, 0, 0, 0});
+		if (encoding.getOptions().verify) {
+			encoding.verify(cached, {0, image.getWidth() * image.getHeight()});
 		}
 
-		Image::Pixel previous_pixel;
+		const std::uint32_t checksum = encoding.getOptions().checksum ? crc32c(cached.data(), cached.size()) : 0;
 
-		std::uint8_t run = 0;
+		output.write({std::move(cached), checksum});
+	}
 
-		for (std::size_t y = start_y; y < end_y && y < image.getHeight(); ++y) {
-			for (std::size_t x = 0; x < image.getWidth(); ++x) {
-				const Image::Pixel pixel = image.getPixel(x, y);
+	// Stripe `i` from the index it can be sure about
+	EncodedStripe encodeStripe(Encoding& encoding, std::size_t i)
+	{
+		return encoding.count(
+			i,
+			[&encoding, i]() -> EncodedStripe
+			{
+				const Image& image = encoding.getImage();
+				const Stripe& stripe = encoding.getStripes()[i];
+				[[maybe_unused]] const auto [first_line, end_line] = getStripeLines(stripe, image.getWidth());
 
-				if (pixel == previous_pixel) {
-					++run;
+				PAM2QOI_PROBE3(stripe__start, i, first_line, end_line);
 
-					if (run == 62) {
-						res.push_back(static_cast<std::uint8_t>(Tag::LONG_RUN));
-						run = 0;
-					}
+				std::string data = encodeQoi(image, stripe, encoding.getEncodeOptions(i));
 
-					continue;
-				}
+				PAM2QOI_PROBE4(stripe__end, i, first_line, end_line, data.size());
 
-				if (run) {
-					res.push_back(static_cast<std::uint8_t>(Tag::RUN) | (run - 1));
-					run = 0;
-				}
+				return encoding.finish(i, std::move(data));
+			}
+		);
+	}
 
-				const std::uint8_t hash = (pixel.r * 3 + pixel.g * 5 + pixel.b * 7 + pixel.a * 11) % 64;
+	void encodeSingleStripe(Encoding& encoding, Output& output)
+	{
+		output.write(encodeStripe(encoding, 0));
+	}
 
-				if (index[hash] && index[hash] == pixel) {
-					res.push_back(static_cast<std::uint8_t>(Tag::INDEX) | hash);
-					previous_pixel = pixel;
+	// The stripes on `threads` threads, written in order
+	void encodeStripes(Encoding& encoding, unsigned int threads, Output& output)
+	{
+		runStripes(
+			encoding.getStripes().size(),
+			threads,
+			[&encoding](std::size_t i) -> EncodedStripe
+			{
+				return encodeStripe(encoding, i);
+			},
+			[&output](std::size_t, EncodedStripe&& result)
+			{
+				output.write(result);
+			}
+		);
+	}
 
-					continue;
-				}
+	struct RepairStatistics {
+		// In all stripes
+		std::chrono::steady_clock::duration time{0};
+		std::size_t ops = 0;
+	};
 
-				index[hash] = pixel;
+	// All stripes start from an index guessed from the line before them,
+	// or the `--warm-up` pixels. The real index at the start of a stripe
+	// follows from the one before as soon as that stripe is encoded, and
+	// is handed on right away. Each stripe then repairs the few ops that
+	// would have hit it, and is checksummed and verified by its own
+	// thread while it's still in the cache.
+	RepairStatistics encodeSpeculative(Encoding& encoding, unsigned int threads, Output& output)
+	{
+		const Image& image = encoding.getImage();
+		const std::vector<Stripe>& stripes = encoding.getStripes();
+		const std::size_t warm_up = encoding.getOptions().encode.warm_up;
 
-				if (pixel.a != previous_pixel.a) {
-					res.push_back(static_cast<std::uint8_t>(Tag::RGBA));
-					res.push_back(pixel.r);
-					res.push_back(pixel.g);
-					res.push_back(pixel.b);
-					res.push_back(pixel.a);
-					previous_pixel = pixel;
+		std::vector<std::promise<QoiIndex>> promises(stripes.size());
+		std::vector<std::future<QoiIndex>> start_indices;
+		start_indices.reserve(stripes.size());
 
-					continue;
-				}
+		for (std::promise<QoiIndex>& promise : promises) {
+			start_indices.push_back(promise.get_future());
+		}
+
+		QoiIndex first_index;
+		first_index.fill(Image::Pixel{0, 0, 0, 0});
+		promises[0].set_value(first_index);
 
-				const auto is_within =
-					[](std::int8_t value, std::int8_t low, std::int8_t high) -> bool
+		std::atomic<std::chrono::steady_clock::duration::rep> repair_ticks(0);
+		std::atomic<std::size_t> repaired_ops(0);
+
+		runStripes(
+			stripes.size(),
+			threads,
+			[&](std::size_t i) -> EncodedStripe
+			{
+				return encoding.count(
+					i,
+					[&]() -> EncodedStripe
 					{
-						return value >= low && value <= high;
-					};
+						const Stripe& stripe = stripes[i];
+						[[maybe_unused]] const auto [first_line, end_line] = getStripeLines(stripe, image.getWidth());
 
-				const std::int8_t vr = pixel.r - previous_pixel.r;
-				const std::int8_t vg = pixel.g - previous_pixel.g;
-				const std::int8_t vb = pixel.b - previous_pixel.b;
+						PAM2QOI_PROBE3(stripe__start, i, first_line, end_line);
 
-				previous_pixel = pixel;
+						QoiSpeculation speculation;
+						std::string data;
+						QoiIndex index;
 
-				if (
-					is_within(vr, -2, 1)
-					&& is_within(vg, -2, 1)
-					&& is_within(vb, -2, 1)
-				) {
-					res.push_back(static_cast<std::uint8_t>(Tag::DIFF) | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+						try {
+							speculation.start_index = guessQoiIndex(image, stripe.begin, warm_up ? warm_up : image.getWidth());
 
-					continue;
-				}
+							data = encodeQoi(image, stripe, encoding.getEncodeOptions(i), &speculation);
+							index = start_indices[i].get();
+
+							if (i + 1 < stripes.size()) {
+								QoiIndex next_index = index;
+								advanceQoiIndex(next_index, speculation);
+								promises[i + 1].set_value(next_index);
+							}
+						}
+						catch (...) {
+							// The following stripes would wait forever
+							if (i + 1 < stripes.size()) {
+								promises[i + 1].set_exception(std::current_exception());
+							}
 
-				const std::int8_t vg_r = vr - vg;
-				const std::int8_t vg_b = vb - vg;
+							throw;
+						}
 
-				if (
-					is_within(vg_r, -8, 7)
-					&& is_within(vg, -32, 31)
-					&& is_within(vg_b, -8, 7)
-				) {
-					res.push_back(static_cast<std::uint8_t>(Tag::LUMA) | (vg + 32));
-					res.push_back((vg_r + 8) << 4 | (vg_b + 8));
+						const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-					continue;
-				}
+						repaired_ops += repairQoi(data, speculation, index);
+
+						repair_ticks += (std::chrono::steady_clock::now() - start).count();
+
+						PAM2QOI_PROBE4(stripe__end, i, first_line, end_line, data.size());
+
+						return encoding.finish(i, std::move(data));
+					}
+				);
+			},
+			[&output](std::size_t, EncodedStripe&& result)
+			{
+				output.write(result);
+			}
+		);
+
+		return {std::chrono::steady_clock::duration(repair_ticks), repaired_ops};
+	}
 
-				res.push_back(static_cast<std::uint8_t>(Tag::RGB));
-				res.push_back(pixel.r);
-				res.push_back(pixel.g);
-				res.push_back(pixel.b);
+	// Stores `data` under `key` if given and counts the lookup. The QOI
+	// is already written by then, so a full disk or a read-only cache
+	// directory only costs later runs their hit.
+	void updateCache(const QoiCache& cache, const std::string& key, bool hit, const std::string* data)
+	{
+		try {
+			if (data) {
+				cache.store(key, *data);
 			}
 		}
+		catch (const std::exception& exception) {
+			std::cerr << "Cache: warning: " << exception.what() << std::endl;
+		}
 
-		if (run) {
-			res.push_back(static_cast<std::uint8_t>(Tag::RUN) | (run - 1));
+		try {
+			const QoiCache::Statistics statistics = cache.count(hit);
+
+			std::cerr << "Cache: " << (hit ? "hit" : "miss") << ", " << statistics.hits << " of " << statistics.lookups << " lookups hit (" << statistics.hits * 100 / statistics.lookups << "%)" << std::endl;
+		}
+		catch (const std::exception& exception) {
+			std::cerr << "Cache: " << (hit ? "hit" : "miss") << ", warning: " << exception.what() << std::endl;
 		}
+	}
 
-		if (end_y + 1 >= image.getHeight()) {
-			// End marker
-			for (unsigned int i = 0; i < 7; ++i) {
-				res.push_back(0);
-			}
+	void reportReadAhead(const ReadAheadBuffer::Statistics& statistics)
+	{
+		// The part of the time in read() that the conversion hid
+		const auto hidden = std::max(statistics.reading - statistics.waiting, std::chrono::steady_clock::duration(0));
+
+		std::cerr << "Read-ahead: " << describeBytes(statistics.bytes) << " in " << statistics.buffers << " buffers, "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>(statistics.reading).count() << "ms reading, "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>(statistics.waiting).count() << "ms waiting, "
+			<< (statistics.reading.count() ? hidden * 100 / statistics.reading : 0) << "% overlapped" << std::endl;
+	}
 
-			res.push_back(1);
+	void reportCounters(const PerfCounters& read_counters, const CounterValues& read_values, const CounterValues& encode_values, const StripeCounters& stripe_counters, std::size_t pixels)
+	{
+		if (!read_counters.isAvailable()) {
+			std::cerr << "Counters: unavailable (" << read_counters.getError() << ")" << std::endl;
+			return;
 		}
 
-		return res;
+		std::cerr << "Counters: read: " << describeCounters(read_values, pixels) << std::endl;
+		std::cerr << "Counters: encode: " << describeCounters(encode_values, pixels) << std::endl;
+
+		const std::vector<StripeCounters::Thread>& threads = stripe_counters.getThreads();
+
+		for (std::size_t i = 0; i < threads.size(); ++i) {
+			std::cerr << "Counters: thread " << i + 1 << ", " << threads[i].stripes << " stripes: " << describeCounters(threads[i].values, threads[i].pixels) << std::endl;
+		}
+	}
+
+	void reportMemory(const std::optional<std::uint64_t>& read_peak_rss, const std::optional<std::uint64_t>& encode_peak_rss, bool peak_rss_reset)
+	{
+		std::cerr << "Memory: read: peak RSS " << (read_peak_rss ? describeBytes(*read_peak_rss) : "unknown")
+			<< ", encode: peak RSS " << (encode_peak_rss ? describeBytes(*encode_peak_rss) : "unknown") << (peak_rss_reset ? "" : " including read") << std::endl;
+
+		for (const AllocationSite site : {AllocationSite::IMAGE_PIXELS, AllocationSite::LINE_BUFFER, AllocationSite::STRIPE, AllocationSite::OTHER}) {
+			const AllocationStatistics statistics = AllocationScope::get(site);
+
+			std::cerr << "Memory: " << getAllocationSiteName(site) << ": " << describeBytes(statistics.bytes) << " in " << statistics.allocations << " allocations, " << statistics.reallocations << " reallocations" << std::endl;
+		}
 	}
 
 }
@@ -458,61 +999,186 @@ namespace
 int main(int argc, char** argv)
 try
 {
+	const Options options = parseOptions(argc, argv);
+
+	if (options.memory) {
+		AllocationScope::enable();
+		resetPeakRss();
+	}
+
+	std::optional<PerfCounters> read_counters;
+
+	if (options.counters) {
+		read_counters.emplace();
+		read_counters->start();
+	}
+
 	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-	const Image image = readPam(std::cin);
+	// The deadline includes reading
+	const std::chrono::steady_clock::time_point cutoff = start + options.deadline.value_or(std::chrono::milliseconds(0));
+
+	std::optional<QoiCache> cache;
+
+	if (options.cache) {
+		cache.emplace(*options.cache);
+	}
+
+	// Hashed while reading, for looking the image up in the cache
+	XxHash64 input_hash;
+
+	PAM2QOI_PROBE0(read__start);
+
+	ReadStatistics read_statistics;
+	const Image image = readImage(options, cache ? &input_hash : nullptr, read_statistics);
+
+	PAM2QOI_PROBE2(read__end, image.getWidth(), image.getHeight());
 
 	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
 
+	const CounterValues read_values = read_counters ? read_counters->stop() : CounterValues();
+
+	std::optional<std::uint64_t> read_peak_rss;
+	// Without a reset the encoding peak includes reading
+	bool peak_rss_reset = false;
+
+	if (options.memory) {
+		read_peak_rss = getPeakRss();
+		peak_rss_reset = resetPeakRss();
+	}
+
 	if (!image) {
 		throw std::runtime_error("Empty input image.");
 	}
 
 	std::cerr << "Read: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms" << std::endl;
 
+	if (read_statistics.read_ahead) {
+		reportReadAhead(*read_statistics.read_ahead);
+	}
+
+	if (read_statistics.uncached_mode) {
+		std::cerr << "Uncached: " << read_statistics.uncached_mode;
+
+		if (read_statistics.page_cache_change) {
+			const std::int64_t change = *read_statistics.page_cache_change;
+
+			std::cerr << ", page cache " << (change < 0 ? "-" : "+") << describeBytes(change < 0 ? -change : change);
+		}
+
+		std::cerr << std::endl;
+	}
+
 	const unsigned int threads =
-		[argc, argv, &image]() -> unsigned int
+		[&options]() -> unsigned int
 		{
-			unsigned int res = std::min<std::size_t>(std::thread::hardware_concurrency(), image.getHeight());
+			unsigned int res = std::max(1U, std::thread::hardware_concurrency());
 
-			if (argc > 1) {
-				res = std::min<unsigned int>(std::stoul(argv[1]), res);
+			if (options.threads) {
+				res = std::min<unsigned long>(*options.threads, res);
 			}
 
-			return res;
+			return std::max(1U, res);
 		}();
 
+	if (options.bench_scaling) {
+		benchmarkScaling(image, options, threads);
+		return 0;
+	}
+
+	const std::vector<Stripe> stripes =
+		options.stripe_lines
+			? layoutStripeLines(image.getWidth(), image.getHeight(), *options.stripe_lines)
+			: layoutStripes(image.getWidth(), image.getHeight(), options.stripes ? *options.stripes : threads);
+
+	const std::string cache_key = cache ? getCacheKey(options, stripes, input_hash) : std::string();
+	std::optional<std::string> cached = cache ? cache->load(cache_key) : std::nullopt;
+	const bool hit = cached.has_value();
+
+	Encoding encoding(image, options, stripes, cutoff);
+	Output output(cache && !hit, options.checksum);
+
+	// Inherited by the stripe threads, which are only created below
+	std::optional<PerfCounters> encode_counters;
+
+	if (options.counters) {
+		encode_counters.emplace(true);
+		encode_counters->start();
+	}
+
 	start = std::chrono::steady_clock::now();
 
-	if (threads < 2) {
-		std::cout << encodeQoi(image, 0, image.getHeight());
+	RepairStatistics repair;
+
+	if (hit) {
+		writeCached(encoding, std::move(*cached), output);
+	} else if (stripes.size() < 2) {
+		encodeSingleStripe(encoding, output);
+	} else if (options.speculative) {
+		repair = encodeSpeculative(encoding, threads, output);
 	} else {
-		std::vector<std::future<std::string>> results;
-		results.reserve(threads);
+		encodeStripes(encoding, threads, output);
+	}
+
+	std::cout.flush();
 
-		const std::size_t lines_per_pack = std::max<std::size_t>(1, image.getHeight() / threads);
-		const std::size_t lines_first_pack = image.getHeight() - (threads - 1) * lines_per_pack;
+	PAM2QOI_PROBE1(output__flush, output.getWritten());
 
-		for (std::size_t start_y = 0, end_y = lines_first_pack; start_y < image.getHeight(); start_y = end_y, end_y += lines_per_pack) {
-			results.push_back(
-				std::async(
-					std::launch::async,
-					encodeQoi,
-					std::cref(image),
-					start_y,
-					end_y
-				)
-			);
+	end = std::chrono::steady_clock::now();
+
+	const CounterValues encode_values = encode_counters ? encode_counters->stop() : CounterValues();
+
+	const std::optional<std::uint64_t> encode_peak_rss = options.memory ? getPeakRss() : std::nullopt;
+
+	std::cerr << "Write: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms" << std::endl;
+
+	const std::vector<char>& degraded = encoding.getDegraded();
+	const std::size_t degraded_count = std::count(degraded.begin(), degraded.end(), 1);
+
+	if (cache) {
+		// Degraded output depends on timing, so it isn't what the key
+		// stands for
+		updateCache(*cache, cache_key, hit, !hit && !degraded_count ? &output.getData() : nullptr);
+	}
+
+	if (options.speculative && stripes.size() >= 2 && !hit) {
+		std::cerr << "Repair: " << std::chrono::duration_cast<std::chrono::milliseconds>(repair.time).count() << "ms in all stripes for " << repair.ops << " ops" << std::endl;
+	}
+
+	if (options.deadline && !hit) {
+		std::cerr << "Deadline: " << degraded_count << " of " << stripes.size() << " stripes degraded";
+
+		if (degraded_count) {
+			std::cerr << " (" << describeRanges(degraded) << ")";
 		}
 
-		for (auto&& result : results) {
-			std::cout << result.get();
+		std::cerr << std::endl;
+	}
+
+	if (options.checksum) {
+		std::cerr << "Checksum: CRC32C " << toHex(output.getChecksum(), 8) << std::endl;
+
+		if (options.checksum_file) {
+			std::ofstream file(*options.checksum_file);
+			file << toHex(output.getChecksum(), 8) << std::endl;
+
+			if (!file) {
+				throw std::runtime_error("Could not write " + *options.checksum_file + ".");
+			}
 		}
 	}
 
-	end = std::chrono::steady_clock::now();
+	if (options.counters) {
+		reportCounters(*read_counters, read_values, encode_values, encoding.getCounters(), image.getWidth() * image.getHeight());
+	}
 
-	std::cerr << "Write: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms" << std::endl;
+	if (options.memory) {
+		reportMemory(read_peak_rss, encode_peak_rss, peak_rss_reset);
+	}
+
+	if (options.verify) {
+		std::cerr << "Verify: " << std::chrono::duration_cast<std::chrono::milliseconds>(encoding.getVerifyTime()).count() << "ms in all stripes" << std::endl;
+	}
 
 	return 0;
 }
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// Static probes for tracing with bpftrace, perf or SystemTap, for example
+// `bpftrace -e 'usdt:./pam2qoi:pam2qoi:stripe__end { @bytes = hist(arg3); }'`.
+// A probe is a single NOP plus an ELF note describing where its
+// arguments are, and costs nothing else unless a tracer attaches to it.
+// Uses <sys/sdt.h> where installed, else the note is emitted here for
+// x86-64. Defining PAM2QOI_NO_PROBES compiles them out.
+
+#if defined(PAM2QOI_NO_PROBES)
+
+#define PAM2QOI_PROBE0(name)
+#define PAM2QOI_PROBE1(name, a1)
+#define PAM2QOI_PROBE2(name, a1, a2)
+#define PAM2QOI_PROBE3(name, a1, a2, a3)
+#define PAM2QOI_PROBE4(name, a1, a2, a3, a4)
+
+#elif __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+
+#define PAM2QOI_PROBE0(name) DTRACE_PROBE(pam2qoi, name)
+#define PAM2QOI_PROBE1(name, a1) DTRACE_PROBE1(pam2qoi, name, a1)
+#define PAM2QOI_PROBE2(name, a1, a2) DTRACE_PROBE2(pam2qoi, name, a1, a2)
+#define PAM2QOI_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(pam2qoi, name, a1, a2, a3)
+#define PAM2QOI_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(pam2qoi, name, a1, a2, a3, a4)
+
+#elif defined(__x86_64__) && defined(__ELF__)
+
+// The `.note.stapsdt` layout of <sys/sdt.h> version 3, without
+// semaphores. All arguments are passed as 64 bit values.
+#define PAM2QOI_SDT(name, args, ...) \
+	__asm__ __volatile__( \
+		"990: nop\n" \
+		".pushsection .note.stapsdt, \"?\", \"note\"\n" \
+		".balign 4\n" \
+		".4byte 992f - 991f, 994f - 993f, 3\n" \
+		"991: .asciz \"stapsdt\"\n" \
+		"992: .balign 4\n" \
+		"993: .8byte 990b\n" \
+		".8byte _.stapsdt.base\n" \
+		".8byte 0\n" \
+		".asciz \"pam2qoi\"\n" \
+		".asciz \"" #name "\"\n" \
+		".asciz \"" args "\"\n" \
+		"994: .balign 4\n" \
+		".popsection\n" \
+		".ifndef _.stapsdt.base\n" \
+		".pushsection .stapsdt.base, \"aG\", \"progbits\", .stapsdt.base, comdat\n" \
+		".weak _.stapsdt.base\n" \
+		".hidden _.stapsdt.base\n" \
+		"_.stapsdt.base: .space 1\n" \
+		".size _.stapsdt.base, 1\n" \
+		".popsection\n" \
+		".endif\n" \
+		: \
+		: __VA_ARGS__ \
+	)
+
+#define PAM2QOI_SDT_ARG(n, value) [a##n] "nor"(static_cast<std::int64_t>(value))
+
+#define PAM2QOI_PROBE0(name) PAM2QOI_SDT(name, "", )
+#define PAM2QOI_PROBE1(name, a1) \
+	PAM2QOI_SDT(name, "8@%[a1]", PAM2QOI_SDT_ARG(1, a1))
+#define PAM2QOI_PROBE2(name, a1, a2) \
+	PAM2QOI_SDT(name, "8@%[a1] 8@%[a2]", PAM2QOI_SDT_ARG(1, a1), PAM2QOI_SDT_ARG(2, a2))
+#define PAM2QOI_PROBE3(name, a1, a2, a3) \
+	PAM2QOI_SDT(name, "8@%[a1] 8@%[a2] 8@%[a3]", PAM2QOI_SDT_ARG(1, a1), PAM2QOI_SDT_ARG(2, a2), PAM2QOI_SDT_ARG(3, a3))
+#define PAM2QOI_PROBE4(name, a1, a2, a3, a4) \
+	PAM2QOI_SDT(name, "8@%[a1] 8@%[a2] 8@%[a3] 8@%[a4]", PAM2QOI_SDT_ARG(1, a1), PAM2QOI_SDT_ARG(2, a2), PAM2QOI_SDT_ARG(3, a3), PAM2QOI_SDT_ARG(4, a4))
+
+#else
+
+#define PAM2QOI_PROBE0(name)
+#define PAM2QOI_PROBE1(name, a1)
+#define PAM2QOI_PROBE2(name, a1, a2)
+#define PAM2QOI_PROBE3(name, a1, a2, a3)
+#define PAM2QOI_PROBE4(name, a1, a2, a3, a4)
+
+#endif
@@ -0,0 +1,812 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "benchmark.h"
+#include "hash.h"
+#include "image.h"
+#include "pam.h"
+#include "qoi.h"
+#include "stripes.h"
+#include "synthetic.h"
+
+#define QOI_IMPLEMENTATION
+#include "reference/qoi.h"
+
+using namespace pam2qoi;
+
+namespace
+{
+
+	struct Size {
+		std::size_t width;
+		std::size_t height;
+	};
+
+	struct Options {
+		std::vector<Size> sizes;
+		std::vector<Content> contents;
+		unsigned int threads = std::max(1U, std::thread::hardware_concurrency());
+		std::string filter;
+		double min_time = 0.1;
+		unsigned int repetitions = 3;
+		// "-" writes the CSV to stdout and the table to stderr
+		std::string csv;
+		// Write the corpus as PAMs into this directory instead of benchmarking
+		std::string corpus;
+	};
+
+	Options parseOptions(int argc, char** argv)
+	{
+		Options res;
+
+		for (int i = 1; i < argc; ++i) {
+			const std::string name = argv[i];
+
+			const auto value =
+				[&]() -> std::string
+				{
+					if (i + 1 < argc) {
+						return argv[++i];
+					}
+
+					throw std::runtime_error("Missing value for option " + name + ".");
+				};
+
+			if (name == "--size") {
+				const std::string size = value();
+				const std::string::size_type x = size.find('x');
+
+				if (x == std::string::npos) {
+					throw std::runtime_error("Size must be given as WxH.");
+				}
+
+				res.sizes.push_back({std::stoul(size.substr(0, x)), std::stoul(size.substr(x + 1))});
+			}
+			else if (name == "--content") {
+				res.contents.push_back(parseContent(value()));
+			}
+			else if (name == "--threads") {
+				res.threads = std::max(1UL, std::stoul(value()));
+			}
+			else if (name == "--filter") {
+				res.filter = value();
+			}
+			else if (name == "--min-time") {
+				res.min_time = std::stod(value());
+			}
+			else if (name == "--repetitions") {
+				res.repetitions = std::stoul(value());
+			}
+			else if (name == "--csv") {
+				res.csv = value();
+			}
+			else if (name == "--corpus") {
+				res.corpus = value();
+			}
+			else {
+				throw std::runtime_error("Unknown option " + name + ".");
+			}
+		}
+
+		if (res.sizes.empty()) {
+			res.sizes = {{256, 256}, {1920, 1080}};
+		}
+
+		if (res.contents.empty()) {
+			res.contents.assign(getContents().begin(), getContents().end());
+		}
+
+		return res;
+	}
+
+	// In `count` stripes on `threads` threads, with `speculative` like
+	// pam2qoi --speculative
+	std::vector<std::string> encodeStripes(const Image& image, unsigned int threads, std::size_t count, bool speculative = false)
+	{
+		const std::vector<Stripe> stripes = layoutStripes(image.getWidth(), image.getHeight(), count);
+
+		std::vector<std::string> res;
+		res.reserve(stripes.size());
+
+		QoiIndex index;
+		index.fill(Image::Pixel{0, 0, 0, 0});
+
+		runStripes(
+			stripes.size(),
+			threads,
+			[&image, &stripes, speculative](std::size_t i) -> std::pair<std::string, QoiSpeculation>
+			{
+				if (!speculative) {
+					return {encodeQoi(image, stripes[i]), {}};
+				}
+
+				QoiSpeculation speculation;
+				speculation.start_index = guessQoiIndex(image, stripes[i].begin, image.getWidth());
+
+				std::string data = encodeQoi(image, stripes[i], {}, &speculation);
+
+				return {std::move(data), std::move(speculation)};
+			},
+			[&res, &index, speculative](std::size_t, std::pair<std::string, QoiSpeculation>&& stripe)
+			{
+				if (speculative) {
+					repairQoi(stripe.first, stripe.second, index);
+					advanceQoiIndex(index, stripe.second);
+				}
+
+				res.push_back(std::move(stripe.first));
+			}
+		);
+
+		return res;
+	}
+
+	// The memory bandwidth with one and `--threads` threads, the roofline
+	// of the other benchmarks. Each thread copies or reads its share of
+	// 64 MiB, far more than any cache. A copy counts the bytes read and
+	// written.
+	void addRooflines(BenchmarkRunner& runner, const Options& options)
+	{
+		constexpr std::size_t size = 64 * 1024 * 1024;
+
+		const auto for_each_thread =
+			[](unsigned int threads, const std::function<void (unsigned int)>& function)
+			{
+				std::vector<std::thread> workers;
+
+				for (unsigned int i = 1; i < threads; ++i) {
+					workers.emplace_back(function, i);
+				}
+
+				function(0);
+
+				for (std::thread& worker : workers) {
+					worker.join();
+				}
+			};
+
+		for (const unsigned int threads : {1U, options.threads}) {
+			const std::size_t share = size / threads / sizeof(std::uint64_t) * sizeof(std::uint64_t);
+
+			runner.addRoofline(
+				"bandwidth",
+				{{"kernel", "memcpy"}, {"threads", std::to_string(threads)}},
+				[threads, share, for_each_thread](BenchmarkState& state)
+				{
+					std::vector<char> source(share * threads, 1);
+					std::vector<char> destination(share * threads, 0);
+
+					while (state.keepRunning()) {
+						for_each_thread(
+							threads,
+							[&source, &destination, share](unsigned int i)
+							{
+								std::memcpy(destination.data() + i * share, source.data() + i * share, share);
+							}
+						);
+
+						doNotOptimize(destination);
+					}
+
+					state.setBytesProcessed(share * threads * 2);
+				}
+			);
+
+			runner.addRoofline(
+				"bandwidth",
+				{{"kernel", "read"}, {"threads", std::to_string(threads)}},
+				[threads, share, for_each_thread](BenchmarkState& state)
+				{
+					std::vector<std::uint64_t> source(share * threads / sizeof(std::uint64_t), 1);
+					std::vector<std::uint64_t> sums(threads);
+
+					while (state.keepRunning()) {
+						for_each_thread(
+							threads,
+							[&source, &sums, share](unsigned int i)
+							{
+								const std::uint64_t* const begin = source.data() + i * share / sizeof(std::uint64_t);
+								sums[i] = std::accumulate(begin, begin + share / sizeof(std::uint64_t), std::uint64_t(0));
+							}
+						);
+
+						doNotOptimize(sums);
+					}
+
+					state.setBytesProcessed(share * threads);
+				}
+			);
+
+			if (options.threads == 1) {
+				break;
+			}
+		}
+	}
+
+	void addBenchmarks(BenchmarkRunner& runner, const Options& options, const Size& size)
+	{
+		const std::string size_name = std::to_string(size.width) + "x" + std::to_string(size.height);
+		const std::size_t pixels = size.width * size.height;
+
+		runner.add(
+			"pam_header",
+			{{"size", size_name}},
+			[size](BenchmarkState& state)
+			{
+				const std::string header = makePamHeader(size.width, size.height, true);
+
+				while (state.keepRunning()) {
+					std::istringstream stream(header);
+					doNotOptimize(readPamHeader(stream));
+				}
+
+				state.setBytesProcessed(header.size());
+			}
+		);
+
+		for (const Content content : options.contents) {
+			const std::string content_name = getContentName(content);
+			const BenchmarkRunner::Parameters parameters = {{"content", content_name}, {"size", size_name}};
+
+			for (const bool alpha : {false, true}) {
+				const std::size_t depth = alpha ? 4 : 3;
+				const BenchmarkRunner::Parameters depth_parameters = {{"content", content_name}, {"size", size_name}, {"depth", std::to_string(depth)}};
+
+				for (const Swizzle swizzle : {Swizzle::RGBA, Swizzle::BGRA}) {
+					BenchmarkRunner::Parameters swizzle_parameters = depth_parameters;
+					swizzle_parameters.push_back({"swizzle", swizzle == Swizzle::RGBA ? "rgba" : "bgra"});
+
+					runner.add(
+						"pam_convert",
+						swizzle_parameters,
+						[content, size, depth, alpha, swizzle, pixels](BenchmarkState& state)
+						{
+							const std::string pam = makePam(makeSyntheticImage(content, size.width, size.height), alpha);
+							const char* const body = pam.data() + pam.size() - pixels * depth;
+
+							Image image;
+							image.clearAndInitialize(size.width, size.height);
+
+							while (state.keepRunning()) {
+								for (std::size_t y = 0; y < size.height; ++y) {
+									convertPamLine(body + y * size.width * depth, depth, size.width, image.getRow(y), swizzle);
+								}
+
+								doNotOptimize(image);
+							}
+
+							state.setItemsProcessed(pixels);
+							state.setBytesProcessed(pixels * depth);
+						}
+					);
+				}
+
+				for (const bool hash : {false, true}) {
+					BenchmarkRunner::Parameters hash_parameters = depth_parameters;
+					hash_parameters.push_back({"hash", hash ? "xxh64" : "none"});
+
+					runner.add(
+						"read_pam",
+						hash_parameters,
+						[content, size, depth, alpha, pixels, hash](BenchmarkState& state)
+						{
+							const std::string pam = makePam(makeSyntheticImage(content, size.width, size.height), alpha);
+
+							while (state.keepRunning()) {
+								std::istringstream stream(pam);
+								XxHash64 input_hash;
+								doNotOptimize(readPam(stream, {}, hash ? &input_hash : nullptr));
+								doNotOptimize(input_hash.digest());
+							}
+
+							state.setItemsProcessed(pixels);
+							state.setBytesProcessed(pixels * depth);
+						}
+					);
+				}
+			}
+
+			for (const Alpha alpha : {Alpha::PREMULTIPLY, Alpha::UNPREMULTIPLY}) {
+				runner.add(
+					"convert_alpha",
+					{{"content", content_name}, {"size", size_name}, {"alpha", alpha == Alpha::PREMULTIPLY ? "premultiply" : "unpremultiply"}},
+					[content, size, alpha, pixels](BenchmarkState& state)
+					{
+						// The loops are branchless, so converting the same pixels
+						// over and over again costs the same
+						Image image = makeSyntheticImage(content, size.width, size.height);
+
+						while (state.keepRunning()) {
+							for (std::size_t y = 0; y < size.height; ++y) {
+								convertAlpha(image.getRow(y), size.width, alpha);
+							}
+
+							doNotOptimize(image);
+						}
+
+						state.setItemsProcessed(pixels);
+						state.setBytesProcessed(pixels * 4);
+					}
+				);
+			}
+
+			runner.add(
+				"hash",
+				{{"content", content_name}, {"size", size_name}, {"kernel", "scalar"}},
+				[content, size, pixels](BenchmarkState& state)
+				{
+					const Image image = makeSyntheticImage(content, size.width, size.height);
+					const Image::Pixel* const pixels_begin = image.getRow(0);
+					std::array<std::uint8_t, 32> hashes;
+
+					while (state.keepRunning()) {
+						// In the encoder's blocks, each sunk once like with
+						// `block`
+						for (std::size_t block = 0; block < pixels; block += hashes.size()) {
+							const std::size_t count = std::min(hashes.size(), pixels - block);
+
+							// One at a time like the serial encoder used to
+							for (std::size_t i = 0; i < count; ++i) {
+								hashes[i] = hashQoi(pixels_begin[block + i]);
+							}
+
+							doNotOptimize(hashes);
+						}
+					}
+
+					state.setItemsProcessed(pixels);
+				}
+			);
+
+			runner.add(
+				"hash",
+				{{"content", content_name}, {"size", size_name}, {"kernel", "block"}},
+				[content, size, pixels](BenchmarkState& state)
+				{
+					const Image image = makeSyntheticImage(content, size.width, size.height);
+					const Image::Pixel* const pixels_begin = image.getRow(0);
+					std::array<std::uint8_t, 32> hashes;
+
+					while (state.keepRunning()) {
+						for (std::size_t block = 0; block < pixels; block += hashes.size()) {
+							hashQoiBlock(pixels_begin + block, std::min(hashes.size(), pixels - block), hashes.data());
+							doNotOptimize(hashes);
+						}
+					}
+
+					state.setItemsProcessed(pixels);
+				}
+			);
+
+			for (const Effort effort : {Effort::FAST, Effort::NORMAL}) {
+				BenchmarkRunner::Parameters effort_parameters = parameters;
+				effort_parameters.push_back({"effort", effort == Effort::FAST ? "fast" : "normal"});
+
+				runner.add(
+					"encode",
+					effort_parameters,
+					[content, size, pixels, effort](BenchmarkState& state)
+					{
+						const Image image = makeSyntheticImage(content, size.width, size.height);
+						std::size_t bytes = 0;
+
+						EncodeOptions encode_options;
+						encode_options.effort = effort;
+
+						while (state.keepRunning()) {
+							const std::string qoi = encodeQoi(image, 0, image.getHeight(), encode_options);
+							bytes = qoi.size();
+							doNotOptimize(qoi);
+						}
+
+						state.setItemsProcessed(pixels);
+						state.setBytesProcessed(pixels * 4);
+						state.setCounter("ratio", static_cast<double>(bytes) / (pixels * 4));
+					}
+				);
+			}
+
+			runner.add(
+				"reference",
+				parameters,
+				[content, size, pixels](BenchmarkState& state)
+				{
+					const Image image = makeSyntheticImage(content, size.width, size.height);
+					const qoi_desc description = {static_cast<unsigned int>(size.width), static_cast<unsigned int>(size.height), 4, QOI_SRGB};
+
+					std::string reference;
+
+					while (state.keepRunning()) {
+						int length = 0;
+						void* const data = qoi_encode(image.getRow(0), &description, &length);
+
+						if (!data) {
+							throw std::runtime_error("The reference encoder failed.");
+						}
+
+						reference.assign(static_cast<const char*>(data), length);
+						std::free(data);
+						doNotOptimize(reference);
+					}
+
+					// The same number of single stripe encodes for comparison
+					const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+					std::string qoi;
+
+					for (std::size_t i = 0; i < state.getIterations(); ++i) {
+						qoi = encodeQoi(image, 0, image.getHeight());
+						doNotOptimize(qoi);
+					}
+
+					const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+					if (qoi != reference) {
+						throw std::runtime_error("encodeQoi() differs from the reference encoder for " + getContentName(content) + ".");
+					}
+
+					state.setItemsProcessed(pixels);
+					state.setBytesProcessed(pixels * 4);
+					// How many times faster encodeQoi() is
+					state.setCounter("speedup", state.getSeconds() / seconds);
+				}
+			);
+
+			for (const unsigned int tolerance : {0, 1, 2, 4, 8}) {
+				BenchmarkRunner::Parameters tolerance_parameters = parameters;
+				tolerance_parameters.push_back({"tolerance", std::to_string(tolerance)});
+
+				runner.add(
+					"near_lossless",
+					tolerance_parameters,
+					[content, size, pixels, tolerance](BenchmarkState& state)
+					{
+						const Image image = makeSyntheticImage(content, size.width, size.height);
+						std::string qoi;
+
+						EncodeOptions encode_options;
+						encode_options.near_lossless = tolerance;
+
+						while (state.keepRunning()) {
+							qoi = encodeQoi(image, 0, image.getHeight(), encode_options);
+							doNotOptimize(qoi);
+						}
+
+						// Over the color channels, alpha is always exact
+						const Image decoded = decodeQoi(qoi);
+						double squared_error = 0;
+
+						for (std::size_t y = 0; y < image.getHeight(); ++y) {
+							for (std::size_t x = 0; x < image.getWidth(); ++x) {
+								const Image::Pixel a = image.getPixel(x, y);
+								const Image::Pixel b = decoded.getPixel(x, y);
+
+								for (const int difference : {a.r - b.r, a.g - b.g, a.b - b.b}) {
+									squared_error += difference * difference;
+								}
+							}
+						}
+
+						const double mean_squared_error = squared_error / (pixels * 3);
+
+						state.setItemsProcessed(pixels);
+						state.setBytesProcessed(pixels * 4);
+						state.setCounter("ratio", static_cast<double>(qoi.size()) / (pixels * 4));
+						// Lossless shows as infinity
+						state.setCounter("psnr", 10 * std::log10(255.0 * 255.0 / mean_squared_error));
+					}
+				);
+			}
+
+			runner.add(
+				"verify",
+				parameters,
+				[content, size, pixels](BenchmarkState& state)
+				{
+					const Image image = makeSyntheticImage(content, size.width, size.height);
+					const std::string qoi = encodeQoi(image, 0, image.getHeight());
+
+					while (state.keepRunning()) {
+						verifyQoi(image, qoi, 0, pixels);
+					}
+
+					state.setItemsProcessed(pixels);
+					state.setBytesProcessed(pixels * 4);
+				}
+			);
+
+			for (const bool speculative : {false, true}) {
+				runner.add(
+					"encode_striped",
+					{{"content", content_name}, {"size", size_name}, {"threads", std::to_string(options.threads)}, {"mode", speculative ? "speculative" : "plain"}},
+					[content, size, pixels, threads = options.threads, speculative](BenchmarkState& state)
+					{
+						const Image image = makeSyntheticImage(content, size.width, size.height);
+						std::size_t bytes = 0;
+
+						while (state.keepRunning()) {
+							bytes = 0;
+
+							for (const std::string& stripe : encodeStripes(image, threads, threads, speculative)) {
+								bytes += stripe.size();
+							}
+						}
+
+						state.setItemsProcessed(pixels);
+						state.setBytesProcessed(pixels * 4);
+						state.setCounter("ratio", static_cast<double>(bytes) / (pixels * 4));
+					}
+				);
+			}
+
+			// Up to stripes of a quarter line
+			for (const std::size_t count : {std::size_t(options.threads), std::size_t(64), size.height, size.height * 4}) {
+				runner.add(
+					"stripes",
+					{{"content", content_name}, {"size", size_name}, {"threads", std::to_string(options.threads)}, {"stripes", std::to_string(count)}},
+					[content, size, pixels, threads = options.threads, count](BenchmarkState& state)
+					{
+						const Image image = makeSyntheticImage(content, size.width, size.height);
+						const std::size_t serial = encodeQoi(image, 0, image.getHeight()).size();
+
+						std::size_t bytes = 0;
+
+						while (state.keepRunning()) {
+							bytes = 0;
+
+							for (const std::string& stripe : encodeStripes(image, threads, count)) {
+								bytes += stripe.size();
+							}
+						}
+
+						state.setItemsProcessed(pixels);
+						state.setBytesProcessed(pixels * 4);
+						// In percent of a single stripe
+						state.setCounter("overhead", (static_cast<double>(bytes) / serial - 1) * 100);
+					}
+				);
+			}
+
+			for (const std::size_t count : {8, 64, 256}) {
+				for (const std::size_t lines : {0, 1, 16}) {
+					runner.add(
+						"warm_up",
+						{{"content", content_name}, {"size", size_name}, {"stripes", std::to_string(count)}, {"lines", std::to_string(lines)}},
+						[content, size, pixels, count, lines](BenchmarkState& state)
+						{
+							const Image image = makeSyntheticImage(content, size.width, size.height);
+							const std::size_t serial = encodeQoi(image, 0, image.getHeight()).size();
+
+							EncodeOptions encode_options;
+							encode_options.warm_up = lines * image.getWidth();
+
+							std::size_t bytes = 0;
+
+							while (state.keepRunning()) {
+								bytes = 0;
+
+								for (const Stripe& stripe : layoutStripes(image.getWidth(), image.getHeight(), count)) {
+									bytes += encodeQoi(image, stripe, encode_options).size();
+								}
+							}
+
+							state.setItemsProcessed(pixels);
+							state.setBytesProcessed(pixels * 4);
+							// In percent of a single stripe
+							state.setCounter("overhead", (static_cast<double>(bytes) / serial - 1) * 100);
+						}
+					);
+				}
+			}
+
+			runner.add(
+				"crc32c",
+				parameters,
+				[content, size](BenchmarkState& state)
+				{
+					const std::string qoi = encodeQoi(makeSyntheticImage(content, size.width, size.height), 0, size.height);
+
+					while (state.keepRunning()) {
+						doNotOptimize(crc32c(qoi.data(), qoi.size()));
+					}
+
+					state.setBytesProcessed(qoi.size());
+				}
+			);
+
+			runner.add(
+				"concatenate",
+				{{"content", content_name}, {"size", size_name}, {"stripes", "64"}},
+				[content, size](BenchmarkState& state)
+				{
+					const Image image = makeSyntheticImage(content, size.width, size.height);
+
+					std::vector<std::string> stripes;
+
+					for (const Stripe& stripe : layoutStripes(image.getWidth(), image.getHeight(), 64)) {
+						stripes.push_back(encodeQoi(image, stripe));
+					}
+
+					std::size_t bytes = 0;
+
+					while (state.keepRunning()) {
+						std::string qoi;
+						bytes = 0;
+
+						for (const std::string& stripe : stripes) {
+							bytes += stripe.size();
+						}
+
+						qoi.reserve(bytes);
+
+						for (const std::string& stripe : stripes) {
+							qoi += stripe;
+						}
+
+						doNotOptimize(qoi);
+					}
+
+					state.setBytesProcessed(bytes);
+				}
+			);
+
+			const auto add_output =
+				[&runner, &content_name, &size_name, content, size](const std::string& backend, const std::function<void (const std::string&)>& write)
+				{
+					runner.add(
+						"output",
+						{{"content", content_name}, {"size", size_name}, {"backend", backend}},
+						[content, size, write](BenchmarkState& state)
+						{
+							const Image image = makeSyntheticImage(content, size.width, size.height);
+							const std::string qoi = encodeQoi(image, 0, image.getHeight());
+
+							while (state.keepRunning()) {
+								write(qoi);
+							}
+
+							state.setBytesProcessed(qoi.size());
+						}
+					);
+				};
+
+			add_output(
+				"ostream",
+				[](const std::string& qoi)
+				{
+					static std::ofstream stream("/dev/null", std::ios::binary);
+					stream << qoi;
+				}
+			);
+
+			add_output(
+				"fwrite",
+				[](const std::string& qoi)
+				{
+					static std::FILE* const file = std::fopen("/dev/null", "wb");
+					std::fwrite(qoi.data(), 1, qoi.size(), file);
+				}
+			);
+
+#if defined(__unix__) || defined(__APPLE__)
+			add_output(
+				"write",
+				[](const std::string& qoi)
+				{
+					static const int fd = ::open("/dev/null", O_WRONLY);
+
+					for (std::size_t written = 0; written < qoi.size();) {
+						const ssize_t result = ::write(fd, qoi.data() + written, qoi.size() - written);
+
+						if (result <= 0) {
+							break;
+						}
+
+						written += result;
+					}
+				}
+			);
+#endif
+		}
+	}
+
+}
+
+int main(int argc, char** argv)
+try
+{
+	const Options options = parseOptions(argc, argv);
+
+	if (!options.corpus.empty()) {
+		for (const Size& size : options.sizes) {
+			for (const Content content : options.contents) {
+				for (const bool alpha : {false, true}) {
+					const std::string path = options.corpus + "/" + getContentName(content) + "-" + std::to_string(size.width) + "x" + std::to_string(size.height) + (alpha ? "-rgba" : "-rgb") + ".pam";
+					std::ofstream file(path, std::ios::binary);
+
+					file << makePam(makeSyntheticImage(content, size.width, size.height), alpha);
+
+					if (!file) {
+						throw std::runtime_error("Could not write " + path + ".");
+					}
+				}
+			}
+		}
+
+		return 0;
+	}
+
+	BenchmarkRunner runner(options.min_time, options.repetitions);
+
+	addRooflines(runner, options);
+
+	for (const Size& size : options.sizes) {
+		addBenchmarks(runner, options, size);
+	}
+
+	const std::vector<BenchmarkRunner::Result> results = runner.run(options.filter, options.csv == "-" ? std::cerr : std::cout);
+
+	if (options.csv == "-") {
+		BenchmarkRunner::writeCsv(results, std::cout);
+	}
+	else if (!options.csv.empty()) {
+		std::ofstream file(options.csv);
+
+		BenchmarkRunner::writeCsv(results, file);
+
+		if (!file) {
+			throw std::runtime_error("Could not write " + options.csv + ".");
+		}
+	}
+
+	return 0;
+}
+catch (const std::exception& exception)
+{
+	std::cerr << "An error occurred: " << exception.what() << std::endl;
+
+	return 1;
+}
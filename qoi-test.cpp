@@ -0,0 +1,1207 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "image.h"
+#include "pam.h"
+#include "qoi.h"
+#include "readahead.h"
+#include "stripes.h"
+#include "synthetic.h"
+
+#define QOI_IMPLEMENTATION
+#include "reference/qoi.h"
+
+using namespace pam2qoi;
+
+namespace
+{
+
+	unsigned int failures = 0;
+
+	void check(bool condition, const std::string& message)
+	{
+		if (!condition) {
+			std::cerr << "FAILED: " << message << std::endl;
+			++failures;
+		}
+	}
+
+	std::string describe(Content content, std::size_t width, std::size_t height)
+	{
+		return getContentName(content) + " " + std::to_string(width) + "x" + std::to_string(height);
+	}
+
+	// Straight from the specification, deliberately unoptimized and kept
+	// apart from decodeQoi(), so an encoder and decoder that are wrong in
+	// the same way don't pass the round trips
+	Image decodeQoiSpec(const std::string& data)
+	{
+		std::size_t position = 0;
+
+		const auto next =
+			[&data, &position]() -> std::uint8_t
+			{
+				if (position >= data.size()) {
+					throw std::runtime_error("Truncated QOI image.");
+				}
+
+				return data[position++];
+			};
+
+		const auto decode_be =
+			[&next]() -> std::uint32_t
+			{
+				std::uint32_t res = 0;
+
+				for (unsigned int i = 0; i < 4; ++i) {
+					res = res << 8 | next();
+				}
+
+				return res;
+			};
+
+		if (data.compare(0, 4, "qoif") != 0) {
+			throw std::runtime_error("Missing QOI magic.");
+		}
+
+		position = 4;
+
+		const std::uint32_t width = decode_be();
+		const std::uint32_t height = decode_be();
+
+		next();
+		next();
+
+		Image res;
+		res.clearAndInitialize(width, height);
+
+		std::array<Image::Pixel, 64> index;
+		index.fill(Image::Pixel{0, 0, 0, 0});
+
+		Image::Pixel pixel;
+		unsigned int run = 0;
+
+		for (std::size_t i = 0; i < std::size_t(width) * height; ++i) {
+			if (run) {
+				--run;
+			} else {
+				const std::uint8_t tag = next();
+
+				if (tag == 0xFE) {
+					pixel.r = next();
+					pixel.g = next();
+					pixel.b = next();
+				}
+				else if (tag == 0xFF) {
+					pixel.r = next();
+					pixel.g = next();
+					pixel.b = next();
+					pixel.a = next();
+				}
+				else if ((tag & 0xC0) == 0x00) {
+					pixel = index[tag];
+				}
+				else if ((tag & 0xC0) == 0x40) {
+					pixel.r += ((tag >> 4) & 0x03) - 2;
+					pixel.g += ((tag >> 2) & 0x03) - 2;
+					pixel.b += (tag & 0x03) - 2;
+				}
+				else if ((tag & 0xC0) == 0x80) {
+					const std::uint8_t second = next();
+					const int vg = (tag & 0x3F) - 32;
+
+					pixel.r += vg - 8 + ((second >> 4) & 0x0F);
+					pixel.g += vg;
+					pixel.b += vg - 8 + (second & 0x0F);
+				}
+				else {
+					run = tag & 0x3F;
+				}
+
+				index[(pixel.r * 3 + pixel.g * 5 + pixel.b * 7 + pixel.a * 11) % 64] = pixel;
+			}
+
+			res.setPixel(i % width, i / width, pixel);
+		}
+
+		if (data.compare(position, std::string::npos, std::string(7, '\0') + '\1') != 0) {
+			throw std::runtime_error("Missing QOI end marker.");
+		}
+
+		return res;
+	}
+
+	bool isEqual(const Image& a, const Image& b)
+	{
+		if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight()) {
+			return false;
+		}
+
+		for (std::size_t y = 0; y < a.getHeight(); ++y) {
+			for (std::size_t x = 0; x < a.getWidth(); ++x) {
+				if (!(a.getPixel(x, y) == b.getPixel(x, y))) {
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	// Within `tolerance` per color channel, with the same alpha
+	bool isNear(const Image& a, const Image& b, unsigned int tolerance)
+	{
+		if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight()) {
+			return false;
+		}
+
+		for (std::size_t y = 0; y < a.getHeight(); ++y) {
+			for (std::size_t x = 0; x < a.getWidth(); ++x) {
+				const Image::Pixel pixel_a = a.getPixel(x, y);
+				const Image::Pixel pixel_b = b.getPixel(x, y);
+
+				if (
+					std::abs(pixel_a.r - pixel_b.r) > static_cast<int>(tolerance)
+					|| std::abs(pixel_a.g - pixel_b.g) > static_cast<int>(tolerance)
+					|| std::abs(pixel_a.b - pixel_b.b) > static_cast<int>(tolerance)
+					|| pixel_a.a != pixel_b.a
+				) {
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	// Decodes the whole `qoi` with decodeQoi() and the specification's
+	// decoder and compares both to `image`
+	void checkRoundTrip(const std::string& qoi, const Image& image, const std::string& name, unsigned int tolerance = 0)
+	{
+		try {
+			check(isNear(decodeQoi(qoi), image, tolerance), "Round trip of " + name);
+			check(isNear(decodeQoiSpec(qoi), image, tolerance), "Round trip of " + name + " with the specification's decoder");
+		}
+		catch (const std::exception& exception) {
+			check(false, "Decoding " + name + ": " + exception.what());
+		}
+	}
+
+	// verifyQoi() of the encoded `stripe` of `image`
+	void checkVerifies(const Image& image, const std::string& data, const Stripe& stripe, const std::string& name, unsigned int tolerance = 0)
+	{
+		try {
+			verifyQoi(image, data, stripe.begin, stripe.end, tolerance);
+		}
+		catch (const std::exception& exception) {
+			check(false, "Verifying " + name + ": " + exception.what());
+		}
+	}
+
+	Image readPamString(const std::string& pam, const ReadOptions& options = {})
+	{
+		std::istringstream stream(pam);
+		return readPam(stream, options);
+	}
+
+	void testHeader()
+	{
+		const std::string qoi = encodeQoi(makeSyntheticImage(Content::FLAT, 300, 2), 0, 2);
+
+		check(qoi.compare(0, 14, std::string("qoif\0\0\1\x2c\0\0\0\2\4\0", 14)) == 0, "QOI header");
+	}
+
+	void testColorspace()
+	{
+		const Image image = makeSyntheticImage(Content::FLAT, 3, 2);
+
+		EncodeOptions options;
+		options.colorspace = Colorspace::LINEAR;
+
+		check(encodeQoi(image, 0, 2)[13] == 0, "sRGB colorspace byte");
+		check(encodeQoi(image, 0, 2, options)[13] == 1, "Linear colorspace byte");
+	}
+
+	void testHash()
+	{
+		const Image image = makeSyntheticImage(Content::NOISE, 37, 1);
+
+		for (std::size_t count = 0; count <= image.getWidth(); ++count) {
+			std::vector<std::uint8_t> hashes(count);
+			hashQoiBlock(image.getRow(0), count, hashes.data());
+
+			bool equal = true;
+
+			for (std::size_t i = 0; i < count; ++i) {
+				equal = equal && hashes[i] == hashQoi(image.getPixel(i, 0));
+			}
+
+			check(equal, "Hashing a block of " + std::to_string(count) + " pixels");
+		}
+	}
+
+	void testXxHash()
+	{
+		const auto hash =
+			[](const std::string& data) -> std::uint64_t
+			{
+				return XxHash64::hash(data.data(), data.size());
+			};
+
+		check(hash("") == 0xEF46DB3751D8E999ULL, "XXH64 of nothing");
+		check(hash("abc") == 0x44BC2CF5AD770999ULL, "XXH64 of abc");
+		check(hash("Nobody inspects the spammish repetition") == 0xFBCEA83C8A378BF1ULL, "XXH64 of more than 32 bytes");
+
+		const std::string data = makePam(makeSyntheticImage(Content::NOISE, 33, 7), true);
+
+		for (const std::size_t piece : {1, 7, 32, 100}) {
+			XxHash64 pieces;
+
+			for (std::size_t i = 0; i < data.size(); i += piece) {
+				pieces.update(data.substr(i, piece));
+			}
+
+			check(pieces.digest() == hash(data), "XXH64 in pieces of " + std::to_string(piece) + " bytes");
+		}
+
+		const auto read_hash =
+			[](const Image& image, bool alpha) -> std::uint64_t
+			{
+				std::istringstream stream(makePam(image, alpha));
+				XxHash64 res;
+				readPam(stream, {}, &res);
+				return res.digest();
+			};
+
+		Image other = makeSyntheticImage(Content::NOISE, 33, 7);
+		other.setPixel(32, 6, {1, 2, 3, 4});
+
+		check(read_hash(makeSyntheticImage(Content::NOISE, 33, 7), true) == read_hash(makeSyntheticImage(Content::NOISE, 33, 7), true), "Same PAM hash for the same image");
+		check(read_hash(makeSyntheticImage(Content::NOISE, 33, 7), true) != read_hash(other, true), "Other PAM hash for another pixel");
+		// Both bodies are 24 zero bytes
+		Image rgb;
+		rgb.clearAndInitialize(4, 2);
+		Image rgba;
+		rgba.clearAndInitialize(3, 2);
+
+		for (std::size_t y = 0; y < 2; ++y) {
+			for (std::size_t x = 0; x < 4; ++x) {
+				rgb.setPixel(x, y, {0, 0, 0, 255});
+				rgba.setPixel(x, y, {0, 0, 0, 0});
+			}
+		}
+
+		check(read_hash(rgb, false) != read_hash(rgba, true), "Other PAM hash for the same body in other dimensions");
+	}
+
+	void testCrc32c()
+	{
+		check(crc32c("123456789", 9) == 0xE3069283, "CRC32C check value");
+		check(crc32c("", 0) == 0, "CRC32C of nothing");
+
+		const std::string data = encodeQoi(makeSyntheticImage(Content::MIXED, 100, 60), 0, 60);
+		const std::uint32_t whole = crc32c(data.data(), data.size());
+
+		for (const std::size_t piece : {1, 3, 8, 1000, 100000}) {
+			std::uint32_t continued = 0;
+			std::uint32_t combined = 0;
+
+			for (std::size_t i = 0; i < data.size(); i += piece) {
+				const std::string part = data.substr(i, piece);
+
+				continued = crc32c(part.data(), part.size(), continued);
+				combined = combineCrc32c(combined, crc32c(part.data(), part.size()), part.size());
+			}
+
+			check(continued == whole, "CRC32C continued in pieces of " + std::to_string(piece) + " bytes");
+			check(combined == whole, "CRC32C combined from pieces of " + std::to_string(piece) + " bytes");
+		}
+
+		check(combineCrc32c(whole, 0, 0) == whole, "CRC32C combined with nothing");
+	}
+
+	void testRoundTrip()
+	{
+		for (const Content content : getContents()) {
+			for (const auto& size : std::vector<std::array<std::size_t, 2>>{{1, 1}, {7, 5}, {64, 33}, {300, 200}}) {
+				const Image image = makeSyntheticImage(content, size[0], size[1]);
+
+				for (const std::size_t count : {1, 2, 3, 7}) {
+					std::string qoi;
+
+					for (const Stripe& stripe : layoutStripes(image.getWidth(), image.getHeight(), count)) {
+						qoi += encodeQoi(image, stripe);
+					}
+
+					checkRoundTrip(qoi, image, describe(content, size[0], size[1]) + " in " + std::to_string(count) + " stripes");
+				}
+			}
+		}
+	}
+
+	void testStripeStart()
+	{
+		// The decoder continues from the last pixel of the previous stripe,
+		// not from the opaque black it starts the image with
+		Image image;
+		image.clearAndInitialize(3, 2);
+
+		for (std::size_t y = 0; y < image.getHeight(); ++y) {
+			for (std::size_t x = 0; x < image.getWidth(); ++x) {
+				image.setPixel(x, y, {10, 20, 30, 255});
+			}
+		}
+
+		check(encodeQoi(image, 1, 2) == std::string(1, '\xC2') + getQoiEndMarker(), "Second stripe continuing the run of the first");
+		checkRoundTrip(encodeQoi(image, 0, 1) + encodeQoi(image, 1, 2), image, "a stripe continuing the run of the first");
+	}
+
+	void testReference()
+	{
+		for (const Content content : getContents()) {
+			for (const auto& size : std::vector<std::array<std::size_t, 2>>{{1, 1}, {7, 5}, {64, 33}, {300, 200}}) {
+				const Image image = makeSyntheticImage(content, size[0], size[1]);
+				const qoi_desc description = {static_cast<unsigned int>(size[0]), static_cast<unsigned int>(size[1]), 4, QOI_SRGB};
+
+				int length = 0;
+				void* const data = qoi_encode(image.getRow(0), &description, &length);
+				const std::string reference(static_cast<const char*>(data), length);
+				std::free(data);
+
+				check(encodeQoi(image, 0, image.getHeight()) == reference, "Same as the reference encoder for " + describe(content, size[0], size[1]));
+			}
+		}
+	}
+
+	void testStripes()
+	{
+		const Image image = makeSyntheticImage(Content::MIXED, 320, 240);
+		const std::size_t pixels = image.getWidth() * image.getHeight();
+		const std::string serial = encodeQoi(image, 0, image.getHeight());
+
+		std::vector<std::size_t> counts = {image.getHeight() - 1, image.getHeight(), image.getHeight() + 1, image.getHeight() * 4};
+
+		for (std::size_t count = 1; count < image.getHeight() * 4; count = count * 3 / 2 + 1) {
+			counts.push_back(count);
+		}
+
+		for (const std::size_t count : counts) {
+			const std::vector<Stripe> stripes = layoutStripes(image.getWidth(), image.getHeight(), count);
+
+			bool contiguous = stripes.size() == count && stripes.front().begin == 0 && stripes.back().end == pixels;
+
+			for (std::size_t i = 0; i < stripes.size(); ++i) {
+				contiguous =
+					contiguous
+					&& stripes[i].begin < stripes[i].end
+					&& (i == 0 || stripes[i].begin == stripes[i - 1].end)
+					&& (count > image.getHeight() || stripes[i].begin % image.getWidth() == 0);
+			}
+
+			check(contiguous, "Layout of " + std::to_string(count) + " stripes");
+
+			std::string qoi;
+
+			runStripes(
+				stripes.size(),
+				4,
+				[&image, &stripes](std::size_t i) -> std::string
+				{
+					return encodeQoi(image, stripes[i]);
+				},
+				[&qoi](std::size_t, std::string&& stripe)
+				{
+					qoi += stripe;
+				}
+			);
+
+			checkRoundTrip(qoi, image, std::to_string(count) + " stripes");
+
+			// The end marker only once, and each stripe costs a split run
+			// at most
+			check(qoi.size() <= serial.size() + count * 2 + 64 * 5 * count, "Size in " + std::to_string(count) + " stripes");
+		}
+
+		for (const std::size_t count : {image.getHeight(), image.getHeight() * 4}) {
+			const std::vector<Stripe> stripes = layoutStripes(image.getWidth(), image.getHeight(), count);
+
+			for (const std::size_t i : {std::size_t(0), std::size_t(1), stripes.size() - 2, stripes.size() - 1}) {
+				checkVerifies(image, encodeQoi(image, stripes[i]), stripes[i], "stripe " + std::to_string(i) + " of " + std::to_string(count));
+			}
+		}
+
+		check(layoutStripes(2, 2, 9).size() == 4, "At most one stripe per pixel");
+		check(layoutStripes(0, 2, 9).empty(), "No stripes of an empty image");
+	}
+
+	void testStripeLines()
+	{
+		const Image image = makeSyntheticImage(Content::PALETTE, 200, 150);
+
+		for (const std::size_t lines : {1, 7, 64, 150, 1000}) {
+			const std::vector<Stripe> stripes = layoutStripeLines(image.getWidth(), image.getHeight(), lines);
+
+			bool fixed = stripes.size() == (image.getHeight() + lines - 1) / lines && stripes.back().end == image.getWidth() * image.getHeight();
+
+			for (std::size_t i = 0; i < stripes.size(); ++i) {
+				fixed = fixed && stripes[i].begin == i * lines * image.getWidth();
+			}
+
+			check(fixed, "Layout of stripes of " + std::to_string(lines) + " lines");
+
+			std::vector<std::string> results;
+
+			for (const unsigned int threads : {1, 3, 8}) {
+				std::string qoi;
+
+				runStripes(
+					stripes.size(),
+					threads,
+					[&image, &stripes](std::size_t i) -> std::string
+					{
+						return encodeQoi(image, stripes[i]);
+					},
+					[&qoi](std::size_t, std::string&& stripe)
+					{
+						qoi += stripe;
+					}
+				);
+
+				results.push_back(qoi);
+			}
+
+			check(results[0] == results[1] && results[1] == results[2], "Same QOI for stripes of " + std::to_string(lines) + " lines on any number of threads");
+
+			checkRoundTrip(results[0], image, "stripes of " + std::to_string(lines) + " lines");
+		}
+	}
+
+	void testWarmUp()
+	{
+		for (const Content content : getContents()) {
+			const Image image = makeSyntheticImage(content, 64, 40);
+
+			for (const std::size_t count : {2, 5, 13, 40, 97}) {
+				std::size_t cold = 0;
+
+				for (const std::size_t warm_up : {std::size_t(0), std::size_t(1), image.getWidth(), image.getWidth() * image.getHeight()}) {
+					EncodeOptions options;
+					options.warm_up = warm_up;
+
+					std::string qoi;
+
+					for (const Stripe& stripe : layoutStripes(image.getWidth(), image.getHeight(), count)) {
+						qoi += encodeQoi(image, stripe, options);
+					}
+
+					const std::string name = describe(content, 64, 40) + " in " + std::to_string(count) + " stripes warmed up by " + std::to_string(warm_up) + " pixels";
+
+					checkRoundTrip(qoi, image, name);
+
+					if (!warm_up) {
+						cold = qoi.size();
+					}
+
+					check(qoi.size() <= cold, "Not growing " + name);
+				}
+			}
+		}
+	}
+
+	void testSpeculative()
+	{
+		for (const Content content : getContents()) {
+			const Image image = makeSyntheticImage(content, 64, 40);
+			const std::string serial = encodeQoi(image, 0, image.getHeight());
+
+			for (const std::size_t count : {2, 5, 13, 40, 97}) {
+				std::string plain;
+
+				for (const Stripe& stripe : layoutStripes(image.getWidth(), image.getHeight(), count)) {
+					plain += encodeQoi(image, stripe);
+				}
+
+				std::vector<std::string> results;
+
+				for (const std::size_t look_behind : {std::size_t(0), image.getWidth(), image.getWidth() * image.getHeight()}) {
+					QoiIndex index;
+					index.fill(Image::Pixel{0, 0, 0, 0});
+
+					std::string qoi;
+
+					for (const Stripe& stripe : layoutStripes(image.getWidth(), image.getHeight(), count)) {
+						QoiSpeculation speculation;
+						speculation.start_index = guessQoiIndex(image, stripe.begin, look_behind);
+
+						std::string data = encodeQoi(image, stripe, {}, &speculation);
+
+						repairQoi(data, speculation, index);
+						advanceQoiIndex(index, speculation);
+
+						checkVerifies(image, data, stripe, "repaired pixels " + std::to_string(stripe.begin) + " to " + std::to_string(stripe.end) + " of " + describe(content, 64, 40));
+
+						qoi += data;
+					}
+
+					results.push_back(qoi);
+				}
+
+				const std::string name = describe(content, 64, 40) + " in " + std::to_string(count) + " stripes";
+
+				check(results[0] == results[1] && results[1] == results[2], "Repairing " + name + " independent of the look-behind");
+				check(results[0].size() <= plain.size(), "Repairing " + name + " not worse than plain stripes");
+				check(results[0].size() <= serial.size() + count * 2, "Repairing " + name + " as good as serial");
+			}
+		}
+	}
+
+	void testEffort()
+	{
+		EncodeOptions fast;
+		fast.effort = Effort::FAST;
+
+		for (const Content content : getContents()) {
+			const Image image = makeSyntheticImage(content, 64, 40);
+			const std::string normal = encodeQoi(image, 0, image.getHeight());
+
+			for (const std::size_t count : {1, 5, 97}) {
+				const std::string name = describe(content, 64, 40) + " in " + std::to_string(count) + " stripes";
+
+				std::string qoi;
+
+				for (const Stripe& stripe : layoutStripes(image.getWidth(), image.getHeight(), count)) {
+					const std::string data = encodeQoi(image, stripe, fast);
+
+					checkVerifies(image, data, stripe, "fast " + name);
+
+					qoi += data;
+				}
+
+				checkRoundTrip(qoi, image, "fast " + name);
+
+				check(qoi.size() >= normal.size(), "Fast " + name + " not smaller");
+			}
+		}
+
+		// The fast stripes still have to pass the index on
+		const Image image = makeSyntheticImage(Content::PALETTE, 64, 40);
+		QoiIndex index;
+		index.fill(Image::Pixel{0, 0, 0, 0});
+
+		for (const Stripe& stripe : layoutStripes(image.getWidth(), image.getHeight(), 4)) {
+			QoiSpeculation speculation;
+			speculation.start_index = guessQoiIndex(image, stripe.begin, 0);
+			encodeQoi(image, stripe, fast, &speculation);
+			advanceQoiIndex(index, speculation);
+		}
+
+		check(index == guessQoiIndex(image, image.getWidth() * image.getHeight(), image.getWidth() * image.getHeight()), "Index after fast stripes");
+	}
+
+	void testNearLossless()
+	{
+		for (const Content content : getContents()) {
+			const Image image = makeSyntheticImage(content, 64, 40);
+			std::size_t previous_size = encodeQoi(image, 0, image.getHeight()).size();
+
+			for (const unsigned int tolerance : {1, 4, 16}) {
+				EncodeOptions options;
+				options.near_lossless = tolerance;
+
+				for (const std::size_t count : {1, 5, 97}) {
+					const std::string name = describe(content, 64, 40) + " within " + std::to_string(tolerance) + " in " + std::to_string(count) + " stripes";
+
+					std::string qoi;
+
+					for (const Stripe& stripe : layoutStripes(image.getWidth(), image.getHeight(), count)) {
+						const std::string data = encodeQoi(image, stripe, options);
+
+						checkVerifies(image, data, stripe, name, tolerance);
+
+						qoi += data;
+					}
+
+					checkRoundTrip(qoi, image, name, tolerance);
+
+					if (count == 1) {
+						check(qoi.size() <= previous_size, describe(content, 64, 40) + " within " + std::to_string(tolerance) + " not larger");
+						previous_size = qoi.size();
+					}
+				}
+			}
+		}
+
+		// The error must not add up along a gradient
+		Image image;
+		image.clearAndInitialize(256, 1);
+
+		for (std::size_t x = 0; x < 256; ++x) {
+			image.setPixel(x, 0, {static_cast<std::uint8_t>(x), 0, 0, 255});
+		}
+
+		EncodeOptions options;
+		options.near_lossless = 2;
+
+		const std::string qoi = encodeQoi(image, 0, 1, options);
+
+		checkVerifies(image, qoi, {0, 256}, "gradient", 2);
+
+		check(qoi.size() < encodeQoi(image, 0, 1).size(), "Gradient near-lossless smaller");
+
+		// The RUN of the opaque black start pixel puts it into the index,
+		// where the transparent pixel after must not find a near match
+		Image run;
+		run.clearAndInitialize(4, 1);
+		run.setPixel(0, 0, {0, 0, 0, 255});
+		run.setPixel(1, 0, {6, 7, 0, 0});
+		run.setPixel(2, 0, {6, 7, 0, 0});
+		run.setPixel(3, 0, {50, 50, 50, 0});
+
+		options.near_lossless = 8;
+
+		checkVerifies(run, encodeQoi(run, 0, 1, options), {0, 4}, "index after a RUN", 8);
+		checkRoundTrip(encodeQoi(run, 0, 1, options), run, "index after a RUN", 8);
+
+		// The near INDEX hit on (1,0,0,0) takes a zero of the fresh index
+		// from another slot, which the decoder stores in slot 0 then, and
+		// the last pixel's exact INDEX 0 has to find it there
+		Image zero;
+		zero.clearAndInitialize(5, 1);
+		zero.setPixel(0, 0, {64, 0, 0, 0});
+		zero.setPixel(1, 0, {200, 200, 200, 0});
+		zero.setPixel(2, 0, {1, 0, 0, 0});
+		zero.setPixel(3, 0, {200, 200, 200, 0});
+		zero.setPixel(4, 0, {64, 0, 0, 0});
+
+		options.near_lossless = 1;
+
+		checkVerifies(zero, encodeQoi(zero, 0, 1, options), {0, 5}, "index after a near INDEX", 1);
+		checkRoundTrip(encodeQoi(zero, 0, 1, options), zero, "index after a near INDEX", 1);
+	}
+
+	void testVerify()
+	{
+		const Image image = makeSyntheticImage(Content::MIXED, 100, 60);
+		const std::size_t pixels = image.getWidth() * image.getHeight();
+
+		const auto verifies =
+			[&image](const std::string& qoi, std::size_t begin, std::size_t end) -> bool
+			{
+				try {
+					verifyQoi(image, qoi, begin, end);
+				}
+				catch (const std::runtime_error&) {
+					return false;
+				}
+
+				return true;
+			};
+
+		for (const Stripe& stripe : layoutStripes(image.getWidth(), image.getHeight(), 7)) {
+			const std::string qoi = encodeQoi(image, stripe);
+			const std::size_t begin = stripe.begin;
+			const std::size_t end = stripe.end;
+
+			check(verifies(qoi, begin, end), "Verifying pixels " + std::to_string(begin) + " to " + std::to_string(end));
+
+			for (const std::size_t position : {qoi.size() / 3, qoi.size() / 2, qoi.size() - 9}) {
+				std::string corrupt = qoi;
+				corrupt[position] ^= 0x01;
+
+				check(!verifies(corrupt, begin, end), "Detecting a flipped bit at byte " + std::to_string(position) + " of pixels " + std::to_string(begin) + " to " + std::to_string(end));
+			}
+
+			check(!verifies(qoi.substr(0, qoi.size() - 1), begin, end), "Detecting a truncated stripe");
+		}
+
+		check(!verifies(encodeQoi(image, 0, image.getHeight()), 0, pixels - 1), "Detecting trailing data");
+		check(!verifies(encodeQoi(makeSyntheticImage(Content::MIXED, 100, 61), 0, 61), 0, pixels), "Detecting a wrong header");
+	}
+
+	void testReadPam()
+	{
+		const Image image = makeSyntheticImage(Content::MIXED, 37, 19);
+
+		check(isEqual(readPamString(makePam(image, true)), image), "Reading RGB_ALPHA");
+
+		Image opaque = makeSyntheticImage(Content::MIXED, 37, 19);
+
+		for (std::size_t y = 0; y < opaque.getHeight(); ++y) {
+			for (std::size_t x = 0; x < opaque.getWidth(); ++x) {
+				Image::Pixel pixel = opaque.getPixel(x, y);
+				pixel.a = 255;
+				opaque.setPixel(x, y, pixel);
+			}
+		}
+
+		check(isEqual(readPamString(makePam(image, false)), opaque), "Reading RGB");
+
+		const Image small = readPamString("P7\n# comment\nWIDTH 2\n  HEIGHT\t1\nDEPTH 3\nMAXVAL 255\nTUPLTYPE RGB\nENDHDR\nabcdef");
+
+		check(
+			small.getWidth() == 2
+			&& small.getHeight() == 1
+			&& small.getPixel(1, 0) == Image::Pixel{'d', 'e', 'f', 255},
+			"Reading a header with comments and whitespace"
+		);
+
+		const auto throws =
+			[](const std::string& pam) -> bool
+			{
+				try {
+					readPamString(pam);
+				}
+				catch (const std::runtime_error&) {
+					return true;
+				}
+
+				return false;
+			};
+
+		check(throws("P6\n1 1\n255\n"), "Rejecting a PPM");
+		check(throws("P7\nWIDTH 1\nHEIGHT 1\nDEPTH 3\nMAXVAL 255\nTUPLTYPE RGB\n"), "Rejecting a missing ENDHDR");
+		check(throws("P7\nWIDTH 1\nHEIGHT 1\nDEPTH 1\nMAXVAL 255\nTUPLTYPE GRAYSCALE\nENDHDR\n?"), "Rejecting grayscale");
+		check(throws("P7\nWIDTH 1\nHEIGHT 1\nDEPTH 3\nMAXVAL 65535\nTUPLTYPE RGB\nENDHDR\n??????"), "Rejecting 16 bit");
+		check(throws("P7\nWIDTH 2\nHEIGHT 2\nDEPTH 3\nMAXVAL 255\nTUPLTYPE RGB\nENDHDR\nabc"), "Rejecting a truncated body");
+		check(throws("P7\nHEIGHT 1\nDEPTH 3\nMAXVAL 255\nTUPLTYPE RGB\nENDHDR\nabc"), "Rejecting a missing WIDTH");
+		check(throws("P7\nWIDTH 1\nHEIGHT 1\nMAXVAL 255\nTUPLTYPE RGB\nENDHDR\nabc"), "Rejecting a missing DEPTH");
+		check(throws("P7\nWIDTH 1\nHEIGHT 1\nDEPTH 3\nTUPLTYPE RGB\nENDHDR\nabc"), "Rejecting a missing MAXVAL");
+		check(throws("P7\nWIDTH 99999999999\nHEIGHT 99999999999\nDEPTH 3\nMAXVAL 255\nTUPLTYPE RGB\nENDHDR\n"), "Rejecting an overflowing size");
+
+		ReadOptions limited;
+		limited.max_pixels = 100;
+
+		bool limit_thrown = false;
+
+		try {
+			readPamString(makePamHeader(20, 6, false), limited);
+		}
+		catch (const std::runtime_error&) {
+			limit_thrown = true;
+		}
+
+		check(limit_thrown, "Enforcing the pixel limit");
+		check(readPamString(makePam(makeSyntheticImage(Content::FLAT, 20, 5), false), limited).getWidth() == 20, "Accepting an image within the pixel limit");
+
+		bool decode_limit_thrown = false;
+
+		try {
+			decodeQoi(encodeQoi(makeSyntheticImage(Content::FLAT, 20, 6), 0, 6), 100);
+		}
+		catch (const std::runtime_error&) {
+			decode_limit_thrown = true;
+		}
+
+		check(decode_limit_thrown, "Enforcing the pixel limit when decoding");
+	}
+
+	void testReadAhead()
+	{
+		const Image image = makeSyntheticImage(Content::MIXED, 300, 200);
+		const std::string pam = makePam(image, true);
+
+		// Buffers far smaller than the PAM, and writes that don't line up
+		// with them
+		for (const std::size_t buffer_size : {7, 4096, 100000}) {
+			int fds[2];
+
+			if (pipe(fds) != 0) {
+				check(false, "Creating a pipe");
+				return;
+			}
+
+			std::thread writer(
+				[&pam, fd = fds[1]]()
+				{
+					for (std::size_t written = 0; written < pam.size();) {
+						const ssize_t result = ::write(fd, pam.data() + written, std::min<std::size_t>(pam.size() - written, 12345));
+
+						if (result <= 0) {
+							break;
+						}
+
+						written += result;
+					}
+
+					close(fd);
+				}
+			);
+
+			Image read;
+			ReadAheadBuffer::Statistics statistics;
+
+			{
+				ReadAheadBuffer buffer(fds[0], buffer_size);
+				std::istream stream(&buffer);
+
+				read = readPam(stream);
+
+				check(stream.get() == std::char_traits<char>::eof(), "Read-ahead ends with the pipe, " + std::to_string(buffer_size) + " byte buffers");
+
+				statistics = buffer.getStatistics();
+			}
+
+			writer.join();
+			close(fds[0]);
+
+			check(isEqual(read, image), "Reading ahead " + std::to_string(buffer_size) + " byte buffers");
+			check(statistics.bytes == pam.size(), "Read-ahead bytes, " + std::to_string(buffer_size) + " byte buffers");
+		}
+
+		// A writer that keeps the pipe open: The PAM has to arrive without
+		// filling the buffer or the EOF, and the buffer must not wait for
+		// the writer when destroyed
+		{
+			int fds[2];
+
+			if (pipe(fds) != 0) {
+				check(false, "Creating a pipe");
+				return;
+			}
+
+			std::promise<void> read_promise;
+
+			std::thread writer(
+				[&pam, fd = fds[1], read = read_promise.get_future()]()
+				{
+					for (std::size_t written = 0; written < pam.size();) {
+						const ssize_t result = ::write(fd, pam.data() + written, pam.size() - written);
+
+						if (result <= 0) {
+							break;
+						}
+
+						written += result;
+					}
+
+					read.wait();
+					close(fd);
+				}
+			);
+
+			Image read;
+
+			{
+				ReadAheadBuffer buffer(fds[0]);
+				std::istream stream(&buffer);
+
+				read = readPam(stream);
+			}
+
+			read_promise.set_value();
+			writer.join();
+			close(fds[0]);
+
+			check(isEqual(read, image), "Reading ahead from a pipe that stays open");
+		}
+
+		// A failing read() is an error of its own, not a truncated PAM
+		{
+			const int fd = open(".", O_RDONLY | O_DIRECTORY);
+
+			bool thrown = false;
+
+			{
+				ReadAheadBuffer buffer(fd);
+				std::istream stream(&buffer);
+				stream.exceptions(std::ios::badbit);
+
+				try {
+					readPam(stream);
+				}
+				catch (const std::system_error& error) {
+					thrown = error.code().value() == EISDIR;
+				}
+			}
+
+			close(fd);
+
+			check(thrown, "Read-ahead throws read() errors");
+		}
+
+		// A file, dropped from the page cache as it's read
+		std::FILE* const file = std::tmpfile();
+
+		if (!file || std::fwrite(pam.data(), 1, pam.size(), file) != pam.size() || std::fflush(file) != 0) {
+			check(false, "Writing a temporary PAM");
+			return;
+		}
+
+		lseek(fileno(file), 0, SEEK_SET);
+
+		{
+			ReadAheadBuffer buffer(fileno(file), 4096, true);
+			std::istream stream(&buffer);
+
+			check(isEqual(readPam(stream), image), "Reading ahead a file uncached");
+		}
+
+		std::fclose(file);
+	}
+
+	void testAlpha()
+	{
+		const Image image = makeSyntheticImage(Content::NOISE, 64, 17);
+		const std::string pam = makePam(image, true);
+
+		ReadOptions options;
+		options.alpha = Alpha::PREMULTIPLY;
+
+		const Image premultiplied = readPamString(pam, options);
+
+		bool exact = true;
+
+		for (std::size_t y = 0; y < image.getHeight(); ++y) {
+			for (std::size_t x = 0; x < image.getWidth(); ++x) {
+				const Image::Pixel pixel = image.getPixel(x, y);
+
+				const auto multiply =
+					[&pixel](unsigned int value) -> Image::Pixel::Value
+					{
+						return (value * pixel.a * 2 + 255) / 510;
+					};
+
+				exact = exact && premultiplied.getPixel(x, y) == Image::Pixel{multiply(pixel.r), multiply(pixel.g), multiply(pixel.b), pixel.a};
+			}
+		}
+
+		check(exact, "Premultiplying rounds correctly");
+
+		options.alpha = Alpha::UNPREMULTIPLY;
+
+		const Image restored = readPamString(makePam(premultiplied, true), options);
+
+		bool close = true;
+
+		for (std::size_t y = 0; y < image.getHeight(); ++y) {
+			for (std::size_t x = 0; x < image.getWidth(); ++x) {
+				const Image::Pixel original = image.getPixel(x, y);
+				const Image::Pixel pixel = restored.getPixel(x, y);
+
+				// Premultiplying loses up to half a step of 255 / alpha
+				const float tolerance = original.a ? 0.5f * 255 / original.a + 0.5f : 255;
+
+				const auto is_close =
+					[tolerance](int a, int b) -> bool
+					{
+						return std::abs(a - b) <= tolerance;
+					};
+
+				close =
+					close
+					&& is_close(original.r, pixel.r)
+					&& is_close(original.g, pixel.g)
+					&& is_close(original.b, pixel.b)
+					&& original.a == pixel.a;
+			}
+		}
+
+		check(close, "Unpremultiplying restores the colors");
+
+		Image edge;
+		edge.clearAndInitialize(2, 1);
+		edge.setPixel(0, 0, {255, 255, 255, 255});
+		edge.setPixel(1, 0, {255, 0, 0, 0});
+
+		options.scale = 2;
+		options.alpha = Alpha::PREMULTIPLY;
+
+		const Image transparent = readPamString(makePam(edge, true), options);
+
+		check(transparent.getPixel(0, 0) == Image::Pixel{128, 128, 128, 128}, "Averaging boxes premultiplied");
+
+		options.alpha = Alpha::KEEP;
+
+		const Image straight = readPamString(makePam(edge, true), options);
+
+		check(straight.getPixel(0, 0) == Image::Pixel{255, 255, 255, 128}, "Averaging straight boxes weighted by alpha");
+	}
+
+	void testSwizzle()
+	{
+		for (const bool alpha : {false, true}) {
+			for (std::size_t width = 1; width <= 13; ++width) {
+				const Image image = makeSyntheticImage(Content::NOISE, width, 3);
+				std::string pam = makePam(image, alpha);
+
+				// Swapping R and B of every tuple in the body
+				const std::size_t depth = alpha ? 4 : 3;
+
+				for (std::size_t i = pam.size() - width * 3 * depth; i < pam.size(); i += depth) {
+					std::swap(pam[i], pam[i + 2]);
+				}
+
+				const std::string::size_type tuple_type = pam.find(alpha ? "RGB_ALPHA" : "RGB");
+				pam.replace(tuple_type, alpha ? 9 : 3, alpha ? "BGRA" : "BGR");
+
+				ReadOptions options;
+				options.swizzle = Swizzle::BGRA;
+
+				const Image swizzled = readPamString(pam, options);
+				const Image expected = readPamString(makePam(image, alpha));
+
+				check(isEqual(swizzled, expected), std::string("BGR") + (alpha ? "A" : "") + " with width " + std::to_string(width));
+			}
+		}
+
+		bool thrown = false;
+
+		try {
+			readPamString("P7\nWIDTH 1\nHEIGHT 1\nDEPTH 3\nMAXVAL 255\nTUPLTYPE BGR\nENDHDR\nabc");
+		}
+		catch (const std::runtime_error&) {
+			thrown = true;
+		}
+
+		check(thrown, "Rejecting a custom TUPLTYPE without swizzle");
+	}
+
+	void testDownscale()
+	{
+		const Image image = makeSyntheticImage(Content::NOISE, 50, 23);
+		const std::string pam = makePam(image, true);
+
+		for (const std::size_t scale : {2, 3, 7, 64}) {
+			ReadOptions options;
+			options.scale = scale;
+
+			const Image scaled = readPamString(pam, options);
+
+			bool equal =
+				scaled.getWidth() == (image.getWidth() + scale - 1) / scale
+				&& scaled.getHeight() == (image.getHeight() + scale - 1) / scale;
+
+			for (std::size_t y = 0; equal && y < scaled.getHeight(); ++y) {
+				for (std::size_t x = 0; equal && x < scaled.getWidth(); ++x) {
+					// The colors weighted by alpha
+					std::array<unsigned int, 4> sums = {};
+					unsigned int count = 0;
+
+					for (std::size_t v = y * scale; v < std::min(image.getHeight(), (y + 1) * scale); ++v) {
+						for (std::size_t u = x * scale; u < std::min(image.getWidth(), (x + 1) * scale); ++u) {
+							const Image::Pixel pixel = image.getPixel(u, v);
+
+							sums[0] += pixel.r * pixel.a;
+							sums[1] += pixel.g * pixel.a;
+							sums[2] += pixel.b * pixel.a;
+							sums[3] += pixel.a;
+							++count;
+						}
+					}
+
+					const auto average =
+						[](unsigned int value, unsigned int count) -> Image::Pixel::Value
+						{
+							return count ? (value + count / 2) / count : 0;
+						};
+
+					const Image::Pixel expected = {
+						average(sums[0], sums[3]),
+						average(sums[1], sums[3]),
+						average(sums[2], sums[3]),
+						average(sums[3], count)
+					};
+
+					equal = scaled.getPixel(x, y) == expected;
+				}
+			}
+
+			check(equal, "Box filter with scale 1/" + std::to_string(scale));
+		}
+
+		ReadOptions options;
+		options.fit_width = 10;
+		options.fit_height = 10;
+
+		const Image fitted = readPamString(pam, options);
+
+		check(fitted.getWidth() == 10 && fitted.getHeight() == 5, "Fitting into 10x10");
+	}
+
+}
+
+int main()
+{
+	const std::vector<std::pair<std::string, std::function<void ()>>> tests = {
+		{"header", testHeader},
+		{"colorspace", testColorspace},
+		{"hash", testHash},
+		{"xxhash", testXxHash},
+		{"crc32c", testCrc32c},
+		{"round trip", testRoundTrip},
+		{"stripe start", testStripeStart},
+		{"reference", testReference},
+		{"stripes", testStripes},
+		{"stripe lines", testStripeLines},
+		{"warm up", testWarmUp},
+		{"speculative", testSpeculative},
+		{"effort", testEffort},
+		{"near lossless", testNearLossless},
+		{"verify", testVerify},
+		{"readPam", testReadPam},
+		{"read ahead", testReadAhead},
+		{"alpha", testAlpha},
+		{"swizzle", testSwizzle},
+		{"downscale", testDownscale}
+	};
+
+	for (const auto& test : tests) {
+		std::cout << "Testing " << test.first << std::endl;
+
+		try {
+			test.second();
+		}
+		catch (const std::exception& exception) {
+			check(false, test.first + " threw: " + exception.what());
+		}
+	}
+
+	if (failures) {
+		std::cerr << failures << " checks failed." << std::endl;
+		return 1;
+	}
+
+	std::cout << "All checks passed." << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,962 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#endif
+
+#include "image.h"
+
+namespace pam2qoi
+{
+
+	// The pixels [begin, end) of an image in row-major order
+	struct Stripe {
+		std::size_t begin;
+		std::size_t end;
+	};
+
+	// Divides `width` x `height` pixels into `count` stripes for
+	// encodeQoi(). As long as there are enough lines, the stripes consist
+	// of whole lines. Only the first stripe, which has the advantage to
+	// start earlier than its successors, gets some lines more so that the
+	// division is integer. More stripes than lines split the pixels the
+	// same way, down to single pixels.
+	inline std::vector<Stripe> layoutStripes(std::size_t width, std::size_t height, std::size_t count)
+	{
+		std::vector<Stripe> res;
+
+		const std::size_t pixels = width * height;
+
+		if (!pixels || !count) {
+			return res;
+		}
+
+		const std::size_t unit = count <= height ? width : 1;
+		const std::size_t units = pixels / unit;
+
+		count = std::min(count, units);
+
+		const std::size_t units_per_pack = units / count;
+		const std::size_t units_first_pack = units - (count - 1) * units_per_pack;
+
+		res.reserve(count);
+
+		for (std::size_t begin = 0, end = units_first_pack * unit; begin < pixels; begin = end, end += units_per_pack * unit) {
+			res.push_back({begin, end});
+		}
+
+		return res;
+	}
+
+	// Divides `width` x `height` pixels into stripes of `lines` lines
+	// each, the last one taking what's left. Unlike layoutStripes() for
+	// the number of threads, this gives the same QOI on every machine.
+	inline std::vector<Stripe> layoutStripeLines(std::size_t width, std::size_t height, std::size_t lines)
+	{
+		std::vector<Stripe> res;
+
+		if (!width || !height || !lines) {
+			return res;
+		}
+
+		res.reserve((height + lines - 1) / lines);
+
+		for (std::size_t start_y = 0; start_y < height; start_y += lines) {
+			res.push_back({start_y * width, std::min(start_y + lines, height) * width});
+		}
+
+		return res;
+	}
+
+	enum class Colorspace : std::uint8_t {
+		// sRGB with linear alpha
+		SRGB = 0,
+		// All channels linear
+		LINEAR = 1
+	};
+
+	enum class Effort {
+		// Only RUN, DIFF, RGB and RGBA, without hashing
+		FAST,
+		// All ops
+		NORMAL
+	};
+
+	struct EncodeOptions {
+		Colorspace colorspace = Colorspace::SRGB;
+		Effort effort = Effort::NORMAL;
+		// Pixels before a stripe that prefill its index
+		std::size_t warm_up = 0;
+		// How far each color channel may be off, 0 for lossless
+		unsigned int near_lossless = 0;
+	};
+
+	inline std::uint8_t hashQoi(const Image::Pixel& pixel)
+	{
+		return (pixel.r * 3 + pixel.g * 5 + pixel.b * 7 + pixel.a * 11) % 64;
+	}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+	// Eight QOI index hashes at a time, returns how many pixels it did.
+	// Compiled for SSSE3 whatever the flags, so only to be called if the
+	// CPU has it.
+	__attribute__((target("ssse3")))
+	inline std::size_t hashQoiBlockSsse3(const Image::Pixel* pixels, std::size_t count, std::uint8_t* hashes)
+	{
+		// pmaddubsw gives r * 3 + g * 5 and b * 7 + a * 11 per pixel as 16
+		// bits, pmaddwd adds them up, and the packs narrow eight hashes
+		// down to bytes
+		const __m128i weights = _mm_setr_epi8(3, 5, 7, 11, 3, 5, 7, 11, 3, 5, 7, 11, 3, 5, 7, 11);
+		const __m128i ones = _mm_set1_epi16(1);
+		const __m128i mask = _mm_set1_epi16(63);
+
+		std::size_t i = 0;
+
+		for (; i + 8 <= count; i += 8) {
+			const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i));
+			const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i + 4));
+
+			const __m128i sums = _mm_packs_epi32(
+				_mm_madd_epi16(_mm_maddubs_epi16(low, weights), ones),
+				_mm_madd_epi16(_mm_maddubs_epi16(high, weights), ones)
+			);
+
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(hashes + i), _mm_packus_epi16(_mm_and_si128(sums, mask), sums));
+		}
+
+		return i;
+	}
+#endif
+
+	// QOI index hashes of `count` pixels at once. The SSSE3 kernel is
+	// inlined when building for it, e.g. with -march=native, and else
+	// picked at runtime.
+	inline void hashQoiBlock(const Image::Pixel* pixels, std::size_t count, std::uint8_t* hashes)
+	{
+		std::size_t i = 0;
+
+#if defined(__SSSE3__)
+		i = hashQoiBlockSsse3(pixels, count, hashes);
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+		static const bool ssse3 = __builtin_cpu_supports("ssse3");
+
+		if (ssse3) {
+			i = hashQoiBlockSsse3(pixels, count, hashes);
+		}
+#endif
+
+		for (; i < count; ++i) {
+			hashes[i] = hashQoi(pixels[i]);
+		}
+	}
+
+	using QoiIndex = std::array<std::optional<Image::Pixel>, 64>;
+
+	// A pixel whose index entry a stripe didn't know when encoding it
+	struct QoiIndexMiss {
+		// Offset of the pixel's op in the stripe
+		std::size_t offset;
+		Image::Pixel pixel;
+	};
+
+	// For encoding a stripe from a guessed index, see repairQoi()
+	struct QoiSpeculation {
+		// Set by the caller, usually with guessQoiIndex()
+		QoiIndex start_index;
+		// Set by encodeQoi()
+		QoiIndex end_index;
+		std::vector<QoiIndexMiss> misses;
+	};
+
+	// The decoder's index at pixel `begin` as far as the `look_behind`
+	// pixels before tell. The entries are never wrong, as they are the
+	// latest pixels of each hash, but some may be missing.
+	inline QoiIndex guessQoiIndex(const Image& image, std::size_t begin, std::size_t look_behind)
+	{
+		QoiIndex res;
+
+		std::size_t i = 0;
+
+		if (look_behind < begin) {
+			i = begin - look_behind;
+		}
+		else {
+			res.fill(Image::Pixel{0, 0, 0, 0});
+		}
+
+		// The lines are contiguous
+		const Image::Pixel* const pixels = image.getRow(0);
+
+		for (; i < begin; ++i) {
+			res[hashQoi(pixels[i])] = pixels[i];
+		}
+
+		return res;
+	}
+
+	enum class QoiTag : std::uint8_t {
+		INDEX = 0x00,
+		DIFF = 0x40,
+		LUMA = 0x80,
+		RUN = 0xC0,
+		LONG_RUN = 0xFD,
+		RGB = 0xFE,
+		RGBA = 0xFF
+	};
+
+	// The ops of `stripe`, starting from `index` and `previous_pixel`.
+	// `Fast` leaves out the index and LUMA.
+	template<bool Fast>
+	inline void encodeQoiOps(
+		const Image::Pixel* pixels,
+		const Stripe& stripe,
+		QoiIndex& index,
+		Image::Pixel previous_pixel,
+		std::string& res,
+		QoiSpeculation* speculation
+	)
+	{
+		std::uint8_t run = 0;
+
+		// The hashes are computed a block at a time ahead of the serial
+		// part, but only once the first pixel of the block needs one, so
+		// blocks that are a single run don't pay for them
+		constexpr std::size_t block_size = 32;
+		std::array<std::uint8_t, block_size> hashes;
+
+		for (std::size_t block = stripe.begin; block < stripe.end; block += block_size) {
+			const std::size_t block_end = std::min(block + block_size, stripe.end);
+
+			bool hashed = false;
+
+			for (std::size_t i = block; i < block_end; ++i) {
+				const Image::Pixel pixel = pixels[i];
+
+				if (pixel == previous_pixel) {
+					++run;
+
+					if (run == 62) {
+						res.push_back(static_cast<std::uint8_t>(QoiTag::LONG_RUN));
+						run = 0;
+					}
+
+					continue;
+				}
+
+				if (run) {
+					res.push_back(static_cast<std::uint8_t>(QoiTag::RUN) | (run - 1));
+					run = 0;
+				}
+
+				if constexpr (!Fast) {
+					if (!hashed) {
+						hashQoiBlock(pixels + block, block_end - block, hashes.data());
+						hashed = true;
+					}
+
+					const std::uint8_t hash = hashes[i - block];
+
+					if (index[hash]) {
+						if (*index[hash] == pixel) {
+							res.push_back(static_cast<std::uint8_t>(QoiTag::INDEX) | hash);
+							previous_pixel = pixel;
+
+							continue;
+						}
+					}
+					else if (speculation) {
+						speculation->misses.push_back({res.size(), pixel});
+					}
+
+					index[hash] = pixel;
+				}
+
+				if (pixel.a != previous_pixel.a) {
+					res.push_back(static_cast<std::uint8_t>(QoiTag::RGBA));
+					res.push_back(pixel.r);
+					res.push_back(pixel.g);
+					res.push_back(pixel.b);
+					res.push_back(pixel.a);
+					previous_pixel = pixel;
+
+					continue;
+				}
+
+				const auto is_within =
+					[](std::int8_t value, std::int8_t low, std::int8_t high) -> bool
+					{
+						return value >= low && value <= high;
+					};
+
+				const std::int8_t vr = pixel.r - previous_pixel.r;
+				const std::int8_t vg = pixel.g - previous_pixel.g;
+				const std::int8_t vb = pixel.b - previous_pixel.b;
+
+				previous_pixel = pixel;
+
+				if (
+					is_within(vr, -2, 1)
+					&& is_within(vg, -2, 1)
+					&& is_within(vb, -2, 1)
+				) {
+					res.push_back(static_cast<std::uint8_t>(QoiTag::DIFF) | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+
+					continue;
+				}
+
+				if constexpr (!Fast) {
+					const std::int8_t vg_r = vr - vg;
+					const std::int8_t vg_b = vb - vg;
+
+					if (
+						is_within(vg_r, -8, 7)
+						&& is_within(vg, -32, 31)
+						&& is_within(vg_b, -8, 7)
+					) {
+						res.push_back(static_cast<std::uint8_t>(QoiTag::LUMA) | (vg + 32));
+						res.push_back((vg_r + 8) << 4 | (vg_b + 8));
+
+						continue;
+					}
+				}
+
+				res.push_back(static_cast<std::uint8_t>(QoiTag::RGB));
+				res.push_back(pixel.r);
+				res.push_back(pixel.g);
+				res.push_back(pixel.b);
+			}
+		}
+
+		if (run) {
+			res.push_back(static_cast<std::uint8_t>(QoiTag::RUN) | (run - 1));
+		}
+	}
+
+	// Like encodeQoiOps<false>(), but each color channel may be off by up
+	// to `tolerance` if that gives a shorter op. The decoder's pixels are
+	// tracked in `previous_pixel` and `index`, and every pixel is compared
+	// to them, so the error doesn't add up. That includes the decoder
+	// putting the previous pixel into the index on each RUN op, which
+	// lossless encoding can ignore, but a near INDEX match can't. The
+	// last pixel is exact, as the next stripe starts from the one in the
+	// image.
+	inline void encodeQoiNearLossless(
+		const Image::Pixel* pixels,
+		const Stripe& stripe,
+		QoiIndex& index,
+		Image::Pixel previous_pixel,
+		std::string& res,
+		int tolerance
+	)
+	{
+		std::uint8_t run = 0;
+
+		for (std::size_t i = stripe.begin; i < stripe.end; ++i) {
+			const Image::Pixel pixel = pixels[i];
+			const int limit = i + 1 < stripe.end ? tolerance : 0;
+
+			const auto is_near =
+				[limit](const Image::Pixel& a, const Image::Pixel& b) -> bool
+				{
+					return
+						std::abs(a.r - b.r) <= limit
+						&& std::abs(a.g - b.g) <= limit
+						&& std::abs(a.b - b.b) <= limit
+						&& a.a == b.a;
+				};
+
+			if (is_near(pixel, previous_pixel)) {
+				++run;
+
+				if (run == 62) {
+					res.push_back(static_cast<std::uint8_t>(QoiTag::LONG_RUN));
+					index[hashQoi(previous_pixel)] = previous_pixel;
+					run = 0;
+				}
+
+				continue;
+			}
+
+			if (run) {
+				res.push_back(static_cast<std::uint8_t>(QoiTag::RUN) | (run - 1));
+				index[hashQoi(previous_pixel)] = previous_pixel;
+				run = 0;
+			}
+
+			const std::uint8_t hash = hashQoi(pixel);
+
+			if (index[hash] && is_near(*index[hash], pixel)) {
+				res.push_back(static_cast<std::uint8_t>(QoiTag::INDEX) | hash);
+				previous_pixel = *index[hash];
+
+				// A near entry may sit in another slot than its own hash,
+				// like the zeros of a fresh index, and the decoder puts it
+				// there
+				index[hashQoi(previous_pixel)] = previous_pixel;
+
+				continue;
+			}
+
+			Image::Pixel decoded = pixel;
+
+			if (pixel.a != previous_pixel.a) {
+				res.push_back(static_cast<std::uint8_t>(QoiTag::RGBA));
+				res.push_back(pixel.r);
+				res.push_back(pixel.g);
+				res.push_back(pixel.b);
+				res.push_back(pixel.a);
+			}
+			else {
+				// The wrapped differences to the previous pixel, clamped to
+				// what the op can hold. Whether that's near enough is
+				// checked on the decoded pixel, which may wrap around.
+				const int vr = static_cast<std::int8_t>(pixel.r - previous_pixel.r);
+				const int vg = static_cast<std::int8_t>(pixel.g - previous_pixel.g);
+				const int vb = static_cast<std::int8_t>(pixel.b - previous_pixel.b);
+
+				const int dr = std::clamp(vr, -2, 1);
+				const int dg = std::clamp(vg, -2, 1);
+				const int db = std::clamp(vb, -2, 1);
+
+				const Image::Pixel diff = {
+					static_cast<std::uint8_t>(previous_pixel.r + dr),
+					static_cast<std::uint8_t>(previous_pixel.g + dg),
+					static_cast<std::uint8_t>(previous_pixel.b + db),
+					pixel.a
+				};
+
+				const int lg = std::clamp(vg, -32, 31);
+				const int lr = std::clamp(vr - lg, -8, 7);
+				const int lb = std::clamp(vb - lg, -8, 7);
+
+				const Image::Pixel luma = {
+					static_cast<std::uint8_t>(previous_pixel.r + lg + lr),
+					static_cast<std::uint8_t>(previous_pixel.g + lg),
+					static_cast<std::uint8_t>(previous_pixel.b + lg + lb),
+					pixel.a
+				};
+
+				if (is_near(diff, pixel)) {
+					res.push_back(static_cast<std::uint8_t>(QoiTag::DIFF) | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+					decoded = diff;
+				}
+				else if (is_near(luma, pixel)) {
+					res.push_back(static_cast<std::uint8_t>(QoiTag::LUMA) | (lg + 32));
+					res.push_back((lr + 8) << 4 | (lb + 8));
+					decoded = luma;
+				}
+				else {
+					res.push_back(static_cast<std::uint8_t>(QoiTag::RGB));
+					res.push_back(pixel.r);
+					res.push_back(pixel.g);
+					res.push_back(pixel.b);
+				}
+			}
+
+			index[hashQoi(decoded)] = decoded;
+			previous_pixel = decoded;
+		}
+
+		if (run) {
+			res.push_back(static_cast<std::uint8_t>(QoiTag::RUN) | (run - 1));
+		}
+	}
+
+	inline std::string encodeQoi(
+		const Image& image,
+		Stripe stripe,
+		const EncodeOptions& options = {},
+		QoiSpeculation* speculation = nullptr
+	)
+	{
+		const std::size_t pixels = image.getWidth() * image.getHeight();
+
+		stripe.end = std::min(stripe.end, pixels);
+		stripe.begin = std::min(stripe.begin, stripe.end);
+
+		// Each index entry misses at most once
+		if (speculation) {
+			speculation->misses.reserve(64);
+		}
+
+		const AllocationScope scope(AllocationSite::STRIPE);
+
+		std::string res;
+		res.reserve((stripe.end - stripe.begin) * 4 * 2 / 3);
+
+		if (stripe.begin == 0) {
+			// Header
+			const auto encode_be =
+				[&res](std::uint32_t value)
+				{
+					res.push_back(value >> 24);
+					res.push_back(value >> 16);
+					res.push_back(value >> 8);
+					res.push_back(value);
+				};
+
+			res += "qoif";
+			encode_be(image.getWidth());
+			encode_be(image.getHeight());
+			res.push_back(4);
+			res.push_back(static_cast<std::uint8_t>(options.colorspace));
+		}
+
+		// Body
+		QoiIndex index;
+
+		// The fast effort doesn't use it. Near-lossless stripes only use
+		// the pixels they decode themselves, as the ones before differ
+		// from the image.
+		if (options.near_lossless) {
+			if (stripe.begin == 0) {
+				index.fill(Image::Pixel{0, 0, 0, 0});
+			}
+		}
+		else if (options.effort == Effort::NORMAL) {
+			if (speculation) {
+				index = speculation->start_index;
+				speculation->misses.clear();
+			}
+			else if (stripe.begin == 0) {
+				index.fill(Image::Pixel{0, 0, 0, 0});
+			}
+			else if (options.warm_up) {
+				index = guessQoiIndex(image, stripe.begin, options.warm_up);
+			}
+		}
+
+		// The lines are contiguous, so stripes needn't care about them
+		const Image::Pixel* const image_pixels = image.getRow(0);
+
+		// The decoder continues with the last pixel of the previous
+		// stripe, so the encoder has to start from there, too
+		Image::Pixel previous_pixel;
+
+		if (stripe.begin > 0) {
+			previous_pixel = image_pixels[stripe.begin - 1];
+		}
+
+		if (options.near_lossless) {
+			encodeQoiNearLossless(image_pixels, stripe, index, previous_pixel, res, std::min(options.near_lossless, 255u));
+		}
+		else if (options.effort == Effort::FAST) {
+			encodeQoiOps<true>(image_pixels, stripe, index, previous_pixel, res, nullptr);
+		}
+		else {
+			encodeQoiOps<false>(image_pixels, stripe, index, previous_pixel, res, speculation);
+		}
+
+		if (stripe.end == pixels) {
+			// End marker
+			for (unsigned int i = 0; i < 7; ++i) {
+				res.push_back(0);
+			}
+
+			res.push_back(1);
+		}
+
+		if (speculation && options.near_lossless) {
+			// Nothing to repair either, and the following stripes don't
+			// use the index
+			speculation->misses.clear();
+			speculation->end_index = QoiIndex();
+		}
+		else if (speculation && options.effort == Effort::FAST) {
+			// There's nothing to repair, but the following stripes still
+			// need the index the decoder will have
+			speculation->misses.clear();
+			speculation->end_index = guessQoiIndex(image, stripe.end, stripe.end - stripe.begin);
+		}
+		else if (speculation) {
+			speculation->end_index = index;
+		}
+
+		return res;
+	}
+
+	// Encodes the lines [start_y, end_y)
+	inline std::string encodeQoi(
+		const Image& image,
+		std::size_t start_y,
+		std::size_t end_y,
+		const EncodeOptions& options = {},
+		QoiSpeculation* speculation = nullptr
+	)
+	{
+		end_y = std::min(end_y, image.getHeight());
+
+		return encodeQoi(image, Stripe{std::min(start_y, end_y) * image.getWidth(), end_y * image.getWidth()}, options, speculation);
+	}
+
+	// Updates the real `index` at the start of a stripe to the one at
+	// its end. All stripes before must be known.
+	inline void advanceQoiIndex(QoiIndex& index, const QoiSpeculation& speculation)
+	{
+		for (std::size_t hash = 0; hash < index.size(); ++hash) {
+			if (speculation.end_index[hash]) {
+				index[hash] = speculation.end_index[hash];
+			}
+		}
+	}
+
+	// Turns the stripe `data` encoded from a guessed index into what the
+	// real `index` at its start would have given, which is then the same
+	// as if all stripes were encoded in one go. Only the misses can
+	// differ: Those that hit in the real index become INDEX ops. The rest
+	// is the same byte for byte, as after each miss both indices hold the
+	// missed pixel. The ops are replaced in place, moving only what comes
+	// after the first one. Returns the number of ops replaced.
+	inline std::size_t repairQoi(std::string& data, const QoiSpeculation& speculation, const QoiIndex& index)
+	{
+		// Where the unchanged bytes are read from and moved to
+		std::size_t read = 0;
+		std::size_t write = 0;
+		std::size_t replaced = 0;
+
+		for (const QoiIndexMiss& miss : speculation.misses) {
+			const std::uint8_t hash = hashQoi(miss.pixel);
+
+			if (!index[hash] || !(*index[hash] == miss.pixel)) {
+				continue;
+			}
+
+			const std::uint8_t tag = data[miss.offset];
+			const std::size_t length =
+				tag == 0xFF
+					? 5
+					: tag == 0xFE
+						? 4
+						: (tag & 0xC0) == 0x80
+							? 2
+							: 1;
+
+			if (write != read) {
+				std::copy(data.begin() + read, data.begin() + miss.offset, data.begin() + write);
+			}
+
+			write += miss.offset - read;
+			data[write++] = hash;
+			read = miss.offset + length;
+			++replaced;
+		}
+
+		if (write != read) {
+			std::copy(data.begin() + read, data.end(), data.begin() + write);
+			data.resize(write + data.size() - read);
+		}
+
+		return replaced;
+	}
+
+	// Decodes QOI ops pixel by pixel. When starting in the middle of a
+	// stream, the index is unknown and every entry is requested from
+	// `look_behind` on first use.
+	class QoiDecoder final
+	{
+	public:
+		using LookBehind = std::function<Image::Pixel (std::uint8_t hash)>;
+
+		QoiDecoder(const std::string& data, std::size_t position, const Image::Pixel& previous_pixel) :
+			data_(data),
+			position_(position),
+			previous_pixel_(previous_pixel),
+			run_(0)
+		{
+		}
+
+		void fillIndex(const Image::Pixel& pixel)
+		{
+			index_.fill(pixel);
+		}
+
+		void setLookBehind(const LookBehind& look_behind)
+		{
+			look_behind_ = look_behind;
+		}
+
+		Image::Pixel decodePixel()
+		{
+			if (run_) {
+				--run_;
+				return previous_pixel_;
+			}
+
+			Image::Pixel pixel = previous_pixel_;
+
+			const std::uint8_t tag = next();
+
+			if (tag == 0xFE) {
+				pixel.r = next();
+				pixel.g = next();
+				pixel.b = next();
+			}
+			else if (tag == 0xFF) {
+				pixel.r = next();
+				pixel.g = next();
+				pixel.b = next();
+				pixel.a = next();
+			}
+			else if ((tag & 0xC0) == 0x00) {
+				std::optional<Image::Pixel>& entry = index_[tag];
+
+				if (!entry) {
+					if (!look_behind_) {
+						throw std::runtime_error("QOI index entry " + std::to_string(tag) + " used before being set.");
+					}
+
+					entry = look_behind_(tag);
+				}
+
+				pixel = *entry;
+			}
+			else if ((tag & 0xC0) == 0x40) {
+				pixel.r += ((tag >> 4) & 0x03) - 2;
+				pixel.g += ((tag >> 2) & 0x03) - 2;
+				pixel.b += (tag & 0x03) - 2;
+			}
+			else if ((tag & 0xC0) == 0x80) {
+				const std::uint8_t second = next();
+				const int vg = (tag & 0x3F) - 32;
+
+				pixel.r += vg - 8 + ((second >> 4) & 0x0F);
+				pixel.g += vg;
+				pixel.b += vg - 8 + (second & 0x0F);
+			}
+			else {
+				run_ = tag & 0x3F;
+			}
+
+			index_[hashQoi(pixel)] = pixel;
+			previous_pixel_ = pixel;
+
+			return pixel;
+		}
+
+		std::size_t getPosition() const
+		{
+			return position_;
+		}
+
+		// Repetitions of the previous pixel still pending from a RUN op
+		std::uint8_t getRun() const
+		{
+			return run_;
+		}
+
+	private:
+		std::uint8_t next()
+		{
+			if (position_ >= data_.size()) {
+				throw std::runtime_error("Truncated QOI data.");
+			}
+
+			return data_[position_++];
+		}
+
+		const std::string& data_;
+		std::size_t position_;
+
+		Image::Pixel previous_pixel_;
+		std::uint8_t run_;
+
+		std::array<std::optional<Image::Pixel>, 64> index_;
+		LookBehind look_behind_;
+	};
+
+	inline std::string describePixel(const Image::Pixel& pixel)
+	{
+		return
+			std::to_string(pixel.r) + ","
+			+ std::to_string(pixel.g) + ","
+			+ std::to_string(pixel.b) + ","
+			+ std::to_string(pixel.a);
+	}
+
+	inline const std::string& getQoiEndMarker()
+	{
+		static const std::string res = std::string(7, '\0') + '\1';
+		return res;
+	}
+
+	// `max_pixels` limits the allocation for untrusted data, 0 for no limit
+	inline Image decodeQoi(const std::string& data, std::size_t max_pixels = 0)
+	{
+		if (data.size() < 14 || data.compare(0, 4, "qoif") != 0) {
+			throw std::runtime_error("Image is not a QOI.");
+		}
+
+		const auto decode_be =
+			[&data](std::size_t position) -> std::uint32_t
+			{
+				return
+					std::uint32_t(static_cast<std::uint8_t>(data[position])) << 24
+					| std::uint32_t(static_cast<std::uint8_t>(data[position + 1])) << 16
+					| std::uint32_t(static_cast<std::uint8_t>(data[position + 2])) << 8
+					| std::uint32_t(static_cast<std::uint8_t>(data[position + 3]));
+			};
+
+		const std::size_t width = decode_be(4);
+		const std::size_t height = decode_be(8);
+
+		if (max_pixels && width * height > max_pixels) {
+			throw std::runtime_error("QOI image exceeds the pixel limit.");
+		}
+
+		Image res;
+		res.clearAndInitialize(width, height);
+
+		QoiDecoder decoder(data, 14, {});
+		decoder.fillIndex({0, 0, 0, 0});
+
+		for (std::size_t y = 0; y < res.getHeight(); ++y) {
+			for (std::size_t x = 0; x < res.getWidth(); ++x) {
+				res.setPixel(x, y, decoder.decodePixel());
+			}
+		}
+
+		if (decoder.getRun() || data.compare(decoder.getPosition(), std::string::npos, getQoiEndMarker()) != 0) {
+			throw std::runtime_error("Missing QOI end marker.");
+		}
+
+		return res;
+	}
+
+	// Decodes `data`, the encoded pixels [begin, end) of `image` in
+	// row-major order, and throws on the first difference. Stripes can be
+	// checked in parallel: As long as all pixels before `begin` decode
+	// correctly, the decoder state at `begin` follows from `image` alone.
+	// Near-lossless data is checked with its `tolerance`.
+	inline void verifyQoi(const Image& image, const std::string& data, std::size_t begin, std::size_t end, unsigned int tolerance = 0)
+	{
+		const std::size_t width = image.getWidth();
+		const std::size_t pixels = width * image.getHeight();
+
+		std::size_t position = 0;
+
+		if (begin == 0) {
+			std::string header = "qoif";
+
+			for (const std::uint32_t value : {image.getWidth(), image.getHeight()}) {
+				header.push_back(value >> 24);
+				header.push_back(value >> 16);
+				header.push_back(value >> 8);
+				header.push_back(value);
+			}
+
+			header.push_back(4);
+
+			if (data.compare(0, header.size(), header) != 0 || data.size() <= header.size()) {
+				throw std::runtime_error("Verification failed: QOI header doesn't match the image.");
+			}
+
+			position = header.size() + 1;
+		}
+
+		const auto get_pixel =
+			[&image, width](std::size_t i) -> Image::Pixel
+			{
+				return image.getPixel(i % width, i / width);
+			};
+
+		QoiDecoder decoder(data, position, begin ? get_pixel(begin - 1) : Image::Pixel{});
+
+		if (begin == 0) {
+			decoder.fillIndex({0, 0, 0, 0});
+		}
+		else {
+			// The decoder's index holds the latest pixel of each hash
+			decoder.setLookBehind(
+				[&get_pixel, begin](std::uint8_t hash) -> Image::Pixel
+				{
+					for (std::size_t i = begin; i-- > 0;) {
+						const Image::Pixel pixel = get_pixel(i);
+
+						if (hashQoi(pixel) == hash) {
+							return pixel;
+						}
+					}
+
+					return {0, 0, 0, 0};
+				}
+			);
+		}
+
+		for (std::size_t i = begin; i < end; ++i) {
+			Image::Pixel decoded;
+
+			try {
+				decoded = decoder.decodePixel();
+			}
+			catch (const std::runtime_error& error) {
+				throw std::runtime_error("Verification failed at pixel " + std::to_string(i % width) + "," + std::to_string(i / width) + ": " + error.what());
+			}
+
+			const Image::Pixel expected = get_pixel(i);
+
+			const auto is_near =
+				[tolerance](int a, int b) -> bool
+				{
+					return static_cast<unsigned int>(std::abs(a - b)) <= tolerance;
+				};
+
+			if (
+				!is_near(decoded.r, expected.r)
+				|| !is_near(decoded.g, expected.g)
+				|| !is_near(decoded.b, expected.b)
+				|| decoded.a != expected.a
+			) {
+				throw std::runtime_error(
+					"Verification failed at pixel " + std::to_string(i % width) + "," + std::to_string(i / width)
+					+ ": expected " + describePixel(expected) + ", decoded " + describePixel(decoded) + "."
+				);
+			}
+		}
+
+		if (decoder.getRun()) {
+			throw std::runtime_error("Verification failed: QOI run crosses pixel " + std::to_string(end) + ".");
+		}
+
+		const std::string expected_rest = end == pixels ? getQoiEndMarker() : std::string();
+
+		if (data.compare(decoder.getPosition(), std::string::npos, expected_rest) != 0) {
+			throw std::runtime_error("Verification failed: Unexpected QOI data after pixel " + std::to_string(end) + ".");
+		}
+	}
+
+}
@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace pam2qoi
+{
+
+	// Owns a file descriptor and closes it
+	class FileDescriptor final
+	{
+	public:
+		explicit FileDescriptor(int fd = -1) :
+			fd_(fd)
+		{
+		}
+
+		FileDescriptor(FileDescriptor&& other) noexcept :
+			fd_(other.fd_)
+		{
+			other.fd_ = -1;
+		}
+
+		FileDescriptor& operator =(FileDescriptor&& other) noexcept
+		{
+			std::swap(fd_, other.fd_);
+			return *this;
+		}
+
+		~FileDescriptor()
+		{
+			if (fd_ >= 0) {
+				close(fd_);
+			}
+		}
+
+		explicit operator bool() const
+		{
+			return fd_ >= 0;
+		}
+
+		int get() const
+		{
+			return fd_;
+		}
+
+	private:
+		int fd_;
+	};
+
+	// Opens the file `fd` is a regular file descriptor of again with
+	// O_DIRECT, at the same offset. Empty if that isn't possible: O_DIRECT
+	// needs an aligned offset, and not every file system has it, which
+	// only shows when reading.
+	inline FileDescriptor openDirect(int fd)
+	{
+		FileDescriptor res;
+
+#if defined(O_DIRECT)
+		const off_t offset = lseek(fd, 0, SEEK_CUR);
+
+		if (offset < 0 || offset % 4096 != 0) {
+			return res;
+		}
+
+		res = FileDescriptor(open(("/proc/self/fd/" + std::to_string(fd)).c_str(), O_RDONLY | O_DIRECT));
+
+		std::vector<char> probe(2 * 4096);
+		char* const aligned = probe.data() + (4096 - reinterpret_cast<std::uintptr_t>(probe.data()) % 4096) % 4096;
+
+		if (res && (lseek(res.get(), offset, SEEK_SET) != offset || pread(res.get(), aligned, 4096, offset) < 0)) {
+			res = FileDescriptor();
+		}
+#else
+		static_cast<void>(fd);
+#endif
+
+		return res;
+	}
+
+	// The bytes in the system's page cache, shared by all processes
+	inline std::optional<std::uint64_t> getPageCacheSize()
+	{
+		std::ifstream file("/proc/meminfo");
+
+		for (std::string line; std::getline(file, line);) {
+			if (line.compare(0, 7, "Cached:") == 0) {
+				return std::stoull(line.substr(7)) * 1024;
+			}
+		}
+
+		return std::nullopt;
+	}
+
+	// A `std::streambuf` over a file descriptor with a thread reading
+	// ahead into one of two large buffers while the other is consumed,
+	// so reading a pipe overlaps with converting what already arrived.
+	// What a read() returns is handed over right away, so a slow writer
+	// doesn't hold back the bytes it already wrote. The buffers are page
+	// aligned for O_DIRECT. With `drop_cache` the kernel is told to read a
+	// file sequentially and to drop what was read from the page cache.
+	// A failing read() throws a `std::system_error` from the stream, which
+	// needs `badbit` in its exceptions to pass it on.
+	class ReadAheadBuffer final : public std::streambuf
+	{
+	public:
+		struct Statistics {
+			std::uint64_t bytes = 0;
+			std::size_t buffers = 0;
+			// Spent by the thread waiting for data and in read()
+			std::chrono::steady_clock::duration reading{0};
+			// Spent by the consumer waiting for data
+			std::chrono::steady_clock::duration waiting{0};
+		};
+
+		explicit ReadAheadBuffer(int fd, std::size_t buffer_size = 8 * 1024 * 1024, bool drop_cache = false) :
+			fd_(fd),
+			buffer_size_(buffer_size),
+			drop_cache_(drop_cache),
+			storage_{std::vector<char>(buffer_size + ALIGNMENT), std::vector<char>(buffer_size + ALIGNMENT)},
+			buffers_{align(storage_[0].data()), align(storage_[1].data())},
+			stop_pipe_(openPipe()),
+			thread_(&ReadAheadBuffer::run, this)
+		{
+		}
+
+		ReadAheadBuffer(const ReadAheadBuffer& other) = delete;
+		ReadAheadBuffer& operator =(const ReadAheadBuffer& other) = delete;
+
+		// Doesn't wait for the writer of a pipe that's still open: The
+		// thread waits for data in poll(), which the stop pipe wakes up
+		~ReadAheadBuffer() override
+		{
+			{
+				const std::lock_guard<std::mutex> lock(mutex_);
+				stop_ = true;
+			}
+
+			changed_.notify_all();
+
+			const char byte = 0;
+
+			while (::write(stop_pipe_[1], &byte, 1) < 0 && errno == EINTR) {
+			}
+
+			thread_.join();
+
+			close(stop_pipe_[0]);
+			close(stop_pipe_[1]);
+		}
+
+		// Only complete once the end was reached
+		Statistics getStatistics() const
+		{
+			const std::lock_guard<std::mutex> lock(mutex_);
+			return statistics_;
+		}
+
+	protected:
+		int_type underflow() override
+		{
+			if (gptr() < egptr()) {
+				return traits_type::to_int_type(*gptr());
+			}
+
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+			std::unique_lock<std::mutex> lock(mutex_);
+
+			for (;;) {
+				Slot& slot = slots_[current_];
+
+				changed_.wait(
+					lock,
+					[this, &slot]()
+					{
+						return slot.size > consumed_ || slot.complete;
+					}
+				);
+
+				if (slot.size > consumed_) {
+					break;
+				}
+
+				if (slot.end) {
+					statistics_.waiting += std::chrono::steady_clock::now() - start;
+
+					if (slot.error) {
+						throw std::system_error(slot.error, std::generic_category(), "Could not read the input");
+					}
+
+					return traits_type::eof();
+				}
+
+				// The thread moved on, so this buffer is free for it again
+				slot = Slot();
+				consumed_ = 0;
+				current_ ^= 1;
+				changed_.notify_all();
+			}
+
+			statistics_.waiting += std::chrono::steady_clock::now() - start;
+
+			char* const data = buffers_[current_];
+			setg(data, data + consumed_, data + slots_[current_].size);
+			consumed_ = slots_[current_].size;
+
+			return traits_type::to_int_type(*gptr());
+		}
+
+	private:
+		struct Slot {
+			// Bytes the thread read into the buffer so far
+			std::size_t size = 0;
+			// The thread's to fill, until the consumer is done with it
+			bool free = true;
+			// The thread won't read more into it
+			bool complete = false;
+			// The stream ends with it
+			bool end = false;
+			// The errno that ended it, if not EOF
+			int error = 0;
+		};
+
+		static constexpr std::size_t ALIGNMENT = 4096;
+		// What the thread reads at most before handing it over. A file
+		// would be read a whole buffer at once otherwise.
+		static constexpr std::size_t CHUNK_SIZE = 1024 * 1024;
+
+		static char* align(char* data)
+		{
+			const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(data);
+			return data + (ALIGNMENT - address % ALIGNMENT) % ALIGNMENT;
+		}
+
+		static std::array<int, 2> openPipe()
+		{
+			std::array<int, 2> res;
+
+			if (pipe(res.data()) != 0) {
+				throw std::runtime_error("Could not create the read-ahead stop pipe.");
+			}
+
+			return res;
+		}
+
+		void run()
+		{
+#if defined(POSIX_FADV_SEQUENTIAL)
+			if (drop_cache_) {
+				posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+			}
+#endif
+
+			// Where a file is read from, for dropping it from the cache
+			off_t offset = std::max<off_t>(lseek(fd_, 0, SEEK_CUR), 0);
+
+			for (unsigned int index = 0;; index ^= 1) {
+				{
+					std::unique_lock<std::mutex> lock(mutex_);
+
+					changed_.wait(
+						lock,
+						[this, index]()
+						{
+							return stop_ || slots_[index].free;
+						}
+					);
+
+					if (stop_) {
+						return;
+					}
+
+					slots_[index].free = false;
+				}
+
+				char* const buffer = buffers_[index];
+				std::size_t size = 0;
+				bool end = false;
+
+				// A pipe hands out at most its capacity per read()
+				while (size < buffer_size_ && !end) {
+					const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+					pollfd fds[2] = {
+						{fd_, POLLIN, 0},
+						{stop_pipe_[0], POLLIN, 0}
+					};
+
+					const int ready = poll(fds, 2, -1);
+
+					if (ready < 0 && errno == EINTR) {
+						continue;
+					}
+
+					if (fds[1].revents) {
+						return;
+					}
+
+					const ssize_t result =
+						ready < 0
+							? -1
+							: ::read(fd_, buffer + size, std::min(buffer_size_ - size, CHUNK_SIZE));
+
+					if (result < 0 && errno == EINTR) {
+						continue;
+					}
+
+					// Errors end the stream, too, but are thrown by the
+					// consumer instead of looking like a truncated PAM
+					end = result <= 0;
+
+					const int error = result < 0 ? errno : 0;
+
+					if (!end) {
+#if defined(POSIX_FADV_DONTNEED)
+						if (drop_cache_) {
+							posix_fadvise(fd_, offset, result, POSIX_FADV_DONTNEED);
+						}
+#endif
+
+						offset += result;
+						size += result;
+					}
+
+					const std::chrono::steady_clock::duration reading = std::chrono::steady_clock::now() - start;
+
+					{
+						const std::lock_guard<std::mutex> lock(mutex_);
+
+						Slot& slot = slots_[index];
+						slot.size = size;
+						slot.complete = end || size == buffer_size_;
+						slot.end = end;
+						slot.error = error;
+
+						statistics_.reading += reading;
+						statistics_.bytes += std::max<ssize_t>(result, 0);
+						statistics_.buffers += result > 0 && size == static_cast<std::size_t>(result);
+					}
+
+					changed_.notify_all();
+				}
+
+				if (end) {
+					return;
+				}
+			}
+		}
+
+		const int fd_;
+		const std::size_t buffer_size_;
+		const bool drop_cache_;
+		std::vector<char> storage_[2];
+		char* const buffers_[2];
+		// Written to by the destructor to wake the thread up
+		const std::array<int, 2> stop_pipe_;
+
+		mutable std::mutex mutex_;
+		std::condition_variable changed_;
+		Slot slots_[2];
+		// The buffer the get area is in, and how much of it was given to it
+		unsigned int current_ = 0;
+		std::size_t consumed_ = 0;
+		bool stop_ = false;
+		Statistics statistics_;
+
+		// Last, so it starts once everything else is initialized
+		std::thread thread_;
+	};
+
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <future>
+#include <vector>
+
+namespace pam2qoi
+{
+
+	// Runs `task(i)` for `count` stripes on `threads` threads, each taking
+	// the next stripe when done with the last one, so there can be far
+	// more stripes than threads. The results are handed to
+	// `consume(i, result)` in order, in the calling thread, as soon as
+	// they are ready.
+	template<typename Task, typename Consume>
+	void runStripes(std::size_t count, unsigned int threads, const Task& task, const Consume& consume)
+	{
+		using Result = decltype(task(std::size_t()));
+
+		std::vector<std::promise<Result>> promises(count);
+		std::vector<std::future<Result>> results;
+		results.reserve(count);
+
+		for (std::promise<Result>& promise : promises) {
+			results.push_back(promise.get_future());
+		}
+
+		std::atomic<std::size_t> next(0);
+
+		std::vector<std::future<void>> workers;
+		workers.reserve(threads);
+
+		for (unsigned int thread = 0; thread < std::max(1U, threads); ++thread) {
+			workers.push_back(
+				std::async(
+					std::launch::async,
+					[&task, &promises, &next, count]()
+					{
+						for (std::size_t i = next++; i < count; i = next++) {
+							try {
+								promises[i].set_value(task(i));
+							}
+							catch (...) {
+								promises[i].set_exception(std::current_exception());
+							}
+						}
+					}
+				)
+			);
+		}
+
+		try {
+			for (std::size_t i = 0; i < count; ++i) {
+				consume(i, results[i].get());
+			}
+		}
+		catch (...) {
+			// Don't start any more stripes, the workers are joined by
+			// their futures
+			next = count;
+			throw;
+		}
+	}
+
+}
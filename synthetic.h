@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2023-2024 Flössie <floessie.mail@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include "image.h"
+
+namespace pam2qoi
+{
+
+	// Content classes roughly aiming at one QOI op each, plus a mix of them
+	enum class Content {
+		FLAT,
+		GRADIENT,
+		SMOOTH,
+		PALETTE,
+		NOISE,
+		MIXED
+	};
+
+	inline const std::array<Content, 6>& getContents()
+	{
+		static const std::array<Content, 6> res = {
+			Content::FLAT,
+			Content::GRADIENT,
+			Content::SMOOTH,
+			Content::PALETTE,
+			Content::NOISE,
+			Content::MIXED
+		};
+
+		return res;
+	}
+
+	inline std::string getContentName(Content content)
+	{
+		switch (content) {
+			case Content::FLAT: {
+				return "flat";
+			}
+
+			case Content::GRADIENT: {
+				return "gradient";
+			}
+
+			case Content::SMOOTH: {
+				return "smooth";
+			}
+
+			case Content::PALETTE: {
+				return "palette";
+			}
+
+			case Content::NOISE: {
+				return "noise";
+			}
+
+			case Content::MIXED: {
+				return "mixed";
+			}
+		}
+
+		return {};
+	}
+
+	inline Content parseContent(const std::string& name)
+	{
+		for (const Content content : getContents()) {
+			if (getContentName(content) == name) {
+				return content;
+			}
+		}
+
+		throw std::runtime_error("Unknown content class " + name + ".");
+	}
+
+	inline Image makeSyntheticImage(Content content, std::size_t width, std::size_t height, std::uint64_t seed = 1)
+	{
+		// SplitMix64, so the corpus is identical on every platform
+		const auto random =
+			[&seed]() -> std::uint64_t
+			{
+				std::uint64_t z = (seed += 0x9E3779B97F4A7C15);
+				z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+				z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+				return z ^ (z >> 31);
+			};
+
+		std::array<Image::Pixel, 16> palette;
+
+		for (Image::Pixel& color : palette) {
+			const std::uint64_t value = random();
+			color = {
+				static_cast<Image::Pixel::Value>(value),
+				static_cast<Image::Pixel::Value>(value >> 8),
+				static_cast<Image::Pixel::Value>(value >> 16),
+				static_cast<Image::Pixel::Value>(value & 0x1000000 ? 255 : value >> 24)
+			};
+		}
+
+		const auto make_pixel =
+			[&random, &palette](Content content, std::size_t x, std::size_t y) -> Image::Pixel
+			{
+				switch (content) {
+					case Content::FLAT: {
+						return palette[(x / 64 + y / 32) % 4];
+					}
+
+					case Content::GRADIENT: {
+						return {
+							static_cast<Image::Pixel::Value>(x),
+							static_cast<Image::Pixel::Value>(y),
+							static_cast<Image::Pixel::Value>((x + y) / 2),
+							255
+						};
+					}
+
+					case Content::SMOOTH: {
+						return {
+							static_cast<Image::Pixel::Value>(x * 7 + y),
+							static_cast<Image::Pixel::Value>(x * 9 + y * 3),
+							static_cast<Image::Pixel::Value>(x * 11 + y * 5),
+							255
+						};
+					}
+
+					case Content::PALETTE: {
+						return palette[random() % palette.size()];
+					}
+
+					case Content::NOISE: {
+						const std::uint64_t value = random();
+						return {
+							static_cast<Image::Pixel::Value>(value),
+							static_cast<Image::Pixel::Value>(value >> 8),
+							static_cast<Image::Pixel::Value>(value >> 16),
+							static_cast<Image::Pixel::Value>(value >> 24)
+						};
+					}
+
+					case Content::MIXED: {
+						break;
+					}
+				}
+
+				return {};
+			};
+
+		Image res;
+		res.clearAndInitialize(width, height);
+
+		for (std::size_t y = 0; y < height; ++y) {
+			for (std::size_t x = 0; x < width; ++x) {
+				Content pixel_content = content;
+
+				if (content == Content::MIXED) {
+					// Tiles of 16 x 16 pixels with a fixed class each
+					pixel_content = getContents()[(x / 16 * 7 + y / 16 * 3) % (getContents().size() - 1)];
+				}
+
+				res.setPixel(x, y, make_pixel(pixel_content, x, y));
+			}
+		}
+
+		return res;
+	}
+
+	inline std::string makePamHeader(std::size_t width, std::size_t height, bool alpha)
+	{
+		return
+			"P7\nWIDTH " + std::to_string(width)
+			+ "\nHEIGHT " + std::to_string(height)
+			+ "\nDEPTH " + (alpha ? "4" : "3")
+			+ "\nMAXVAL 255\nTUPLTYPE " + (alpha ? "RGB_ALPHA" : "RGB")
+			+ "\nENDHDR\n";
+	}
+
+	inline std::string makePam(const Image& image, bool alpha)
+	{
+		std::string res = makePamHeader(image.getWidth(), image.getHeight(), alpha);
+
+		res.reserve(res.size() + image.getWidth() * image.getHeight() * (alpha ? 4 : 3));
+
+		for (std::size_t y = 0; y < image.getHeight(); ++y) {
+			for (std::size_t x = 0; x < image.getWidth(); ++x) {
+				const Image::Pixel pixel = image.getPixel(x, y);
+
+				res.push_back(pixel.r);
+				res.push_back(pixel.g);
+				res.push_back(pixel.b);
+
+				if (alpha) {
+					res.push_back(pixel.a);
+				}
+			}
+		}
+
+		return res;
+	}
+
+}